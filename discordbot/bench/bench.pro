@@ -0,0 +1,22 @@
+QT       += core
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+CONFIG += thread
+INCLUDEPATH += $$[QT_INSTALL_HEADERS]/QtZlib
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+SOURCES += \
+    main.cpp
+
+HEADERS += \
+    ../crc32.h \
+    ../etf.h \
+    ../gatewaycapture.h \
+    ../json.hpp \
+    ../mpmcqueue.h \
+    crc32bench.h \
+    etfbench.h \
+    queuebench.h
@@ -0,0 +1,107 @@
+#ifndef CRC32BENCH_H
+#define CRC32BENCH_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <zlib.h>
+#include "../crc32.h"
+
+//crc32engine against zlib's crc32(): every length 0..100003 at several alignments through the dispatched path (the
+//PCLMUL/ARMv8 folding constants and tails included) and up to 16KB through the table loops, then throughput of the old byte table loop,
+//slicing-by-8, the dispatched path and zlib on 1KB, 64KB and 8MB buffers
+class crc32bench
+{
+public:
+    inline static int maxlength=100003,tablelength=16384; //The table loops are slow enough that shorter lengths cover them
+    inline static int run()
+    {
+        qInfo().noquote() << QString("crc32: dispatched implementation is %1").arg(crc32engine::name());
+        int failures=verify();
+        benchmark();
+        return failures;
+    }
+    inline static int verify()
+    {
+        QByteArray buffer=randomBytes(maxlength+16);
+        const uchar *base=(const uchar*)buffer.constData();
+        int failures=0;
+        for(int alignment : {0,1,3,7,8,13})
+        {
+            const uchar *data=base+alignment;
+            uLong expected=crc32(0L,Z_NULL,0);
+            for(int length=0; length <= maxlength; length++)
+            {
+                //zlib's crc of every prefix, one byte further each time
+                if(length > 0)
+                    expected=crc32(expected,data+length-1,1);
+                quint32 dispatched=crc32engine::update(0,(const char*)data,length);
+                quint32 sliced=(length <= tablelength ? ~crc32engine::slicing8(~0u,data,length) : (quint32)expected);
+                quint32 bytewise=(length <= tablelength ? ~crc32engine::bytewise(~0u,data,length) : (quint32)expected);
+                if(dispatched!=expected || sliced!=expected || bytewise!=expected)
+                {
+                    if(failures++ < 10)
+                        qCritical().noquote() << QString("crc32 mismatch at length %1 alignment %2: zlib %3 dispatched %4 slicing-by-8 %5 bytewise %6")
+                                                 .arg(length).arg(alignment).arg(hex(expected)).arg(hex(dispatched)).arg(hex(sliced)).arg(hex(bytewise));
+                }
+            }
+        }
+        //combine() against one pass over the whole buffer
+        for(int split : {0,1,63,64,65,4096,maxlength/2,maxlength})
+        {
+            quint32 whole=crc32engine::update(0,(const char*)base,maxlength);
+            quint32 first=crc32engine::update(0,(const char*)base,split),second=crc32engine::update(0,(const char*)base+split,maxlength-split);
+            if(crc32engine::combine(first,second,maxlength-split)!=whole && failures++ < 10)
+                qCritical().noquote() << QString("crc32 combine mismatch splitting at %1").arg(split);
+        }
+        qInfo().noquote() << QString("crc32: zlib equivalence for lengths 0..%1 at 6 alignments and combine(): %2")
+                             .arg(maxlength).arg(failures ? QString("%1 FAILURES").arg(failures) : QString("ok"));
+        return failures;
+    }
+    inline static void benchmark()
+    {
+        for(int size : {1024,64*1024,8*1024*1024})
+        {
+            QByteArray buffer=randomBytes(size);
+            const uchar *data=(const uchar*)buffer.constData();
+            QString line=QString("crc32 %1 KB:").arg(size/1024);
+            line+=throughput("bytewise",size,[&]{ return crc32engine::bytewise(~0u,data,size); });
+            line+=throughput("slicing-by-8",size,[&]{ return crc32engine::slicing8(~0u,data,size); });
+            line+=throughput(crc32engine::name(),size,[&]{ return crc32engine::update(0,(const char*)data,size); });
+            line+=throughput("zlib",size,[&]{ return (quint32)crc32(0L,data,size); });
+            qInfo().noquote() << line;
+        }
+    }
+private:
+    inline static QString hex(quint32 value) { return QString("%1").arg(value,8,16,QChar('0')); }
+    inline static QByteArray randomBytes(int size)
+    {
+        QByteArray bytes(size,'\0');
+        quint64 state=0x9e3779b97f4a7c15ull;
+        for(int i=0; i < size; i++)
+        {
+            state^=state << 13;
+            state^=state >> 7;
+            state^=state << 17;
+            bytes[i]=(char)state;
+        }
+        return bytes;
+    }
+    //Repeats the checksum for at least 200ms and gives GB/s
+    template<class Checksum> inline static QString throughput(const char *name,int size,Checksum checksum)
+    {
+        volatile quint32 sink=0;
+        qint64 bytes=0;
+        QElapsedTimer timer;
+        timer.start();
+        do
+        {
+            for(int i=0; i < 16; i++)
+                sink=sink^checksum();
+            bytes+=16ll*size;
+        } while(timer.nsecsElapsed() < 200*1000*1000);
+        return QString(" %1 %2 GB/s").arg(name).arg(double(bytes)/timer.nsecsElapsed(),0,'f',2);
+    }
+};
+
+#endif // CRC32BENCH_H
@@ -0,0 +1,138 @@
+#ifndef ETFBENCH_H
+#define ETFBENCH_H
+
+#include <QElapsedTimer>
+#include <QDebug>
+#include <atomic>
+#include "../json.hpp"
+#include "../etf.h"
+#include "../gatewaycapture.h"
+
+//Heap allocations made by the whole process, counted by the operator new replacement in main.cpp
+class allocationcounter
+{
+public:
+    inline static std::atomic<quint64> allocations{0},bytes{0};
+};
+
+//GUILD_CREATE decode cost of the two gateway encodings: the same payloads through etf::decode and json::parse,
+//time and heap allocations per payload. Payloads come from a gateway capture ("record" in bot_config.json, either
+//encoding, each is converted to the other) or a synthetic guild when there is none
+class etfbench
+{
+public:
+    inline static int syntheticmembers=10000;
+    inline static int run(const QString &capturepath)
+    {
+        std::vector<payload> payloads;
+        if(!capturepath.isEmpty() && !fromCapture(capturepath,payloads))
+            return 1;
+        if(payloads.empty())
+        {
+            payloads.push_back(encoded(synthetic(syntheticmembers)));
+            qInfo().noquote() << QString("etf: no GUILD_CREATE captured, using a synthetic guild of %1 members").arg(syntheticmembers);
+        }
+        int failures=0;
+        for(auto &p : payloads)
+        {
+            nlohmann::json fromEtf,fromJson;
+            //Both decoders have to agree before their timings mean anything
+            if(!etf::decode(p.binary,fromEtf) || (fromJson=nlohmann::json::parse(p.text,nullptr,false))!=fromEtf)
+            {
+                qCritical().noquote() << QString("etf: payload of %1 bytes decodes differently from its json").arg(p.binary.size());
+                failures++;
+                continue;
+            }
+            result e=measure([&]{ nlohmann::json j; etf::decode(p.binary,j); });
+            result t=measure([&]{ nlohmann::json j=nlohmann::json::parse(p.text); });
+            qInfo().noquote() << QString("etf GUILD_CREATE %1 members, etf %2 KB json %3 KB: etf::decode %4 us %5 allocations, json::parse %6 us %7 allocations")
+                                 .arg(memberCount(fromEtf)).arg(p.binary.size()/1024).arg(p.text.size()/1024)
+                                 .arg(e.micros,0,'f',1).arg(e.allocations).arg(t.micros,0,'f',1).arg(t.allocations);
+        }
+        return failures;
+    }
+private:
+    class payload
+    {
+    public:
+        QByteArray binary;
+        std::string text;
+    };
+    class result
+    {
+    public:
+        double micros=0;
+        quint64 allocations=0;
+    };
+    inline static qint64 memberCount(const nlohmann::json &event)
+    {
+        auto d=event.find("d");
+        if(d==event.end()) return 0;
+        auto m=d->find("members");
+        return m!=d->end() && m->is_array() ? (qint64)m->size() : 0;
+    }
+    inline static payload encoded(const nlohmann::json &event)
+    {
+        return {etf::encode(event),event.dump()};
+    }
+    inline static bool fromCapture(const QString &path,std::vector<payload> &payloads)
+    {
+        gatewayreader reader;
+        if(!reader.open(path))
+        {
+            qCritical().noquote() << QString("etf: could not open capture %1").arg(path);
+            return false;
+        }
+        gatewaycapture::frame frame;
+        while(reader.next(frame))
+        {
+            nlohmann::json event;
+            if(frame.type==gatewaycapture::ETF)
+            {
+                if(!etf::decode(frame.payload,event)) continue;
+            }
+            else
+                event=nlohmann::json::parse(frame.payload.constData(),frame.payload.constData()+frame.payload.size(),nullptr,false);
+            if(event.is_object() && event.value("t",nlohmann::json())=="GUILD_CREATE")
+                payloads.push_back(encoded(event));
+        }
+        qInfo().noquote() << QString("etf: %1 GUILD_CREATE payload(s) in %2").arg(payloads.size()).arg(path);
+        return true;
+    }
+    //Shaped like mockdiscord's GUILD_CREATE
+    inline static nlohmann::json synthetic(int members)
+    {
+        nlohmann::json d={{"id","200000000000000000"},{"name","benchguild"},{"member_count",members},
+                          {"channels",{{{"id","300000000000000000"},{"type",0},{"name","general"}}}},
+                          {"members",nlohmann::json::array()},{"presences",nlohmann::json::array()}};
+        for(int m=0; m < members; m++)
+        {
+            std::string id=std::to_string(400000000000000000ull+m);
+            d["members"].push_back({{"user",{{"id",id},{"username","benchuser"+std::to_string(m)},{"discriminator","0001"},{"avatar",nullptr}}},
+                                    {"roles",nlohmann::json::array()},{"joined_at","2020-01-01T00:00:00.000000+00:00"},{"deaf",false},{"mute",false}});
+            d["presences"].push_back({{"user",{{"id",id}}},{"status",m%3 ? "online" : "idle"},{"activities",nlohmann::json::array()},
+                                      {"client_status",{{"desktop","online"}}}});
+        }
+        return {{"op",0},{"s",2},{"t","GUILD_CREATE"},{"d",d}};
+    }
+    //Runs decode for at least 500ms, time is the average and allocations are per decode
+    template<class Decode> inline static result measure(Decode decode)
+    {
+        result r;
+        quint64 before=allocationcounter::allocations;
+        decode();
+        r.allocations=allocationcounter::allocations-before;
+        int runs=0;
+        QElapsedTimer timer;
+        timer.start();
+        do
+        {
+            decode();
+            runs++;
+        } while(timer.nsecsElapsed() < 500*1000*1000);
+        r.micros=timer.nsecsElapsed()/1e3/runs;
+        return r;
+    }
+};
+
+#endif // ETFBENCH_H
@@ -0,0 +1,44 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include "crc32bench.h"
+#include "queuebench.h"
+#include "etfbench.h"
+#include <cstdlib>
+#include <new>
+
+//Every heap allocation goes through here so etfbench can count them
+void *operator new(std::size_t size)
+{
+    allocationcounter::allocations.fetch_add(1,std::memory_order_relaxed);
+    allocationcounter::bytes.fetch_add(size,std::memory_order_relaxed);
+    if(void *p=std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p,std::size_t) noexcept { std::free(p); }
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Correctness checks and microbenchmarks for the bot's hot paths, exits 1 when a check fails");
+    parser.addHelpOption();
+    parser.addPositionalArgument("suites","Any of: crc32, queue, etf. All of them when left out.");
+    parser.addOption({"capture","Gateway capture to take the etf suite's GUILD_CREATE payloads from.","file"});
+    parser.process(a);
+    QStringList suites=parser.positionalArguments();
+    auto wanted=[&](const QString &suite){ return suites.isEmpty() || suites.contains(suite); };
+
+    int failures=0;
+    if(wanted("crc32"))
+        failures+=crc32bench::run();
+    if(wanted("queue"))
+        failures+=queuebench::run();
+    if(wanted("etf"))
+        failures+=etfbench::run(parser.value("capture"));
+    qInfo().noquote() << (failures ? QString("%1 check(s) FAILED").arg(failures) : QString("All checks passed"));
+    return failures ? 1 : 0;
+}
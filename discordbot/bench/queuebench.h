@@ -0,0 +1,88 @@
+#ifndef QUEUEBENCH_H
+#define QUEUEBENCH_H
+
+#include <QElapsedTimer>
+#include <QDebug>
+#include <thread>
+#include <vector>
+#include "../mpmcqueue.h"
+
+//Contention on mpmcqueue and prioritympmcqueue as the processing threads see it: a few producers (the gateway shards)
+//against 1..32 blocking consumers. Every item has to come out exactly once, each run checks that before reporting throughput
+class queuebench
+{
+public:
+    inline static int producers=4,capacity=4096;
+    inline static quint64 items=2*1000*1000;
+    inline static int run()
+    {
+        int failures=0;
+        for(int consumers : {1,2,4,8,16,32})
+        {
+            mpmcqueue<quint64> queue(capacity);
+            failures+=measure("mpmcqueue",consumers,[&](quint64 v){ return queue.tryPush(v); },
+                              [&](quint64 &v,auto cancelled){ return queue.pop(v,10,cancelled); });
+        }
+        for(int consumers : {1,2,4,8,16,32})
+        {
+            prioritympmcqueue<quint64,3> queue(capacity);
+            failures+=measure("prioritympmcqueue",consumers,[&](quint64 v){ return queue.tryPush(v%3,std::move(v)); },
+                              [&](quint64 &v,auto cancelled){ return queue.pop(v,10,cancelled); });
+        }
+        return failures;
+    }
+private:
+    template<class Push,class Pop> inline static int measure(const char *name,int consumers,Push push,Pop pop)
+    {
+        std::vector<std::atomic<quint8>> seen(items);
+        for(auto &s : seen) s.store(0,std::memory_order_relaxed);
+        std::atomic<quint64> consumed{0};
+        auto finished=[&]{ return consumed.load() >= items; };
+        std::vector<std::thread> threads;
+        QElapsedTimer timer;
+        timer.start();
+        for(int c=0; c < consumers; c++)
+        {
+            threads.emplace_back([&]
+            {
+                while(!finished())
+                {
+                    quint64 v=0;
+                    if(pop(v,finished))
+                    {
+                        seen[v].fetch_add(1,std::memory_order_relaxed);
+                        consumed.fetch_add(1);
+                    }
+                }
+            });
+        }
+        for(int p=0; p < producers; p++)
+        {
+            threads.emplace_back([&,p]
+            {
+                for(quint64 v=p; v < items; v+=producers)
+                {
+                    while(!push(v))
+                        std::this_thread::yield(); //Full, like the storage's overflow path but without dropping
+                }
+            });
+        }
+        for(auto &t : threads)
+            t.join();
+        qint64 nanos=timer.nsecsElapsed();
+        quint64 missing=0,duplicated=0;
+        for(auto &s : seen)
+        {
+            quint8 n=s.load(std::memory_order_relaxed);
+            if(n==0) missing++;
+            else if(n > 1) duplicated++;
+        }
+        bool ok=(missing==0 && duplicated==0);
+        qInfo().noquote() << QString("queue %1 %2 producers %3 consumers: %4 M items/s exactly once: %5")
+                             .arg(name).arg(producers).arg(consumers).arg(items*1000.0/nanos,0,'f',2)
+                             .arg(ok ? QString("ok") : QString("FAILED, %1 missing %2 duplicated").arg(missing).arg(duplicated));
+        return ok ? 0 : 1;
+    }
+};
+
+#endif // QUEUEBENCH_H
@@ -0,0 +1,241 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QtEndian>
+#include <array>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CRC32_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32_TARGET_CLMUL
+#else
+#define CRC32_TARGET_CLMUL __attribute__((target("pclmul,sse4.1")))
+#endif
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRC32) || defined(__linux__))
+#define CRC32_ARM
+#include <arm_acle.h>
+#ifdef __ARM_FEATURE_CRC32
+#define CRC32_TARGET_ARM
+#else
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32_TARGET_ARM __attribute__((target("+crc")))
+#endif
+#endif
+
+using crc32tables=std::array<std::array<quint32,256>,8>;
+//tables[0] is the classic byte table, tables[n] advances it by n more zero bytes
+constexpr crc32tables makeCrc32Tables()
+{
+    crc32tables t{};
+    for(quint32 i=0; i < 256; i++)
+    {
+        quint32 c=i;
+        for(int bit=0; bit < 8; bit++)
+            c=(c&1 ? (c >> 1)^0xedb88320 : c >> 1);
+        t[0][i]=c;
+    }
+    for(int n=1; n < 8; n++)
+        for(int i=0; i < 256; i++)
+            t[n][i]=(t[n-1][i] >> 8)^t[0][t[n-1][i]&0xff];
+    return t;
+}
+
+//gzip/zlib CRC-32 (reflected polynomial 0xedb88320), picks the fastest implementation the cpu has on first use:
+//PCLMULQDQ folding on x86, the ARMv8 crc32 instructions on arm64, slicing-by-8 tables everywhere else
+class crc32engine
+{
+public:
+    static constexpr quint32 polynomial=0xedb88320;
+    using implementation=quint32(*)(quint32 crc,const uchar *data,qint64 size);
+
+    //Continues crc (0 for a fresh checksum) over data, same convention as zlib's crc32()
+    inline static quint32 update(quint32 crc,const char *data,qint64 size)
+    {
+        if(size <= 0) return crc;
+        return ~selected().update(~crc,(const uchar*)data,size);
+    }
+    inline static quint32 checksum(const QByteArray &data) { return update(0,data.constData(),data.size()); }
+    //CRC of A followed by B from crc(A), crc(B) and the length of B, so chunks can be summed independently
+    inline static quint32 combine(quint32 crc1,quint32 crc2,qint64 size2)
+    {
+        if(size2 <= 0) return crc1;
+        return multiply(xPow8n(size2),crc1)^crc2;
+    }
+    inline static const char *name() { return selected().name; }
+
+    //Byte at a time and slicing-by-8 take and return the crc register (pre-inverted) like the hardware paths
+    inline static quint32 bytewise(quint32 crc,const uchar *data,qint64 size)
+    {
+        while(size-- > 0)
+            crc=tables[0][(crc^*data++)&0xff]^(crc >> 8);
+        return crc;
+    }
+    inline static quint32 slicing8(quint32 crc,const uchar *data,qint64 size)
+    {
+        for(; size > 0 && (quintptr(data)&7); size--)
+            crc=tables[0][(crc^*data++)&0xff]^(crc >> 8);
+        for(; size >= 8; size-=8, data+=8)
+        {
+            quint32 low=crc^qFromLittleEndian<quint32>(data);
+            quint32 high=qFromLittleEndian<quint32>(data+4);
+            crc=tables[7][low&0xff]^tables[6][(low >> 8)&0xff]^tables[5][(low >> 16)&0xff]^tables[4][low >> 24]
+               ^tables[3][high&0xff]^tables[2][(high >> 8)&0xff]^tables[1][(high >> 16)&0xff]^tables[0][high >> 24];
+        }
+        return bytewise(crc,data,size);
+    }
+#ifdef CRC32_X86
+    //Folds 64 bytes per iteration with carry-less multiplies, then Barrett reduces (Intel "Fast CRC Computation Using PCLMULQDQ")
+    CRC32_TARGET_CLMUL inline static quint32 clmul(quint32 crc,const uchar *data,qint64 size)
+    {
+        if(size < 64) return slicing8(crc,data,size);
+        alignas(16) static const quint64 k1k2[]={0x0154442bd4,0x01c6e41596};
+        alignas(16) static const quint64 k3k4[]={0x01751997d0,0x00ccaa009e};
+        alignas(16) static const quint64 k5k0[]={0x0163cd6124,0x0000000000};
+        alignas(16) static const quint64 poly[]={0x01db710641,0x01f7011641};
+        qint64 tail=size&15;
+        size-=tail;
+
+        __m128i x1=_mm_loadu_si128((const __m128i*)(data+0x00));
+        __m128i x2=_mm_loadu_si128((const __m128i*)(data+0x10));
+        __m128i x3=_mm_loadu_si128((const __m128i*)(data+0x20));
+        __m128i x4=_mm_loadu_si128((const __m128i*)(data+0x30));
+        x1=_mm_xor_si128(x1,_mm_cvtsi32_si128((int)crc));
+        __m128i k=_mm_load_si128((const __m128i*)k1k2);
+        data+=64;
+        size-=64;
+        while(size >= 64)
+        {
+            __m128i x5=_mm_clmulepi64_si128(x1,k,0x00);
+            __m128i x6=_mm_clmulepi64_si128(x2,k,0x00);
+            __m128i x7=_mm_clmulepi64_si128(x3,k,0x00);
+            __m128i x8=_mm_clmulepi64_si128(x4,k,0x00);
+            x1=_mm_clmulepi64_si128(x1,k,0x11);
+            x2=_mm_clmulepi64_si128(x2,k,0x11);
+            x3=_mm_clmulepi64_si128(x3,k,0x11);
+            x4=_mm_clmulepi64_si128(x4,k,0x11);
+            x1=_mm_xor_si128(_mm_xor_si128(x1,x5),_mm_loadu_si128((const __m128i*)(data+0x00)));
+            x2=_mm_xor_si128(_mm_xor_si128(x2,x6),_mm_loadu_si128((const __m128i*)(data+0x10)));
+            x3=_mm_xor_si128(_mm_xor_si128(x3,x7),_mm_loadu_si128((const __m128i*)(data+0x20)));
+            x4=_mm_xor_si128(_mm_xor_si128(x4,x8),_mm_loadu_si128((const __m128i*)(data+0x30)));
+            data+=64;
+            size-=64;
+        }
+        //Four lanes down to one
+        k=_mm_load_si128((const __m128i*)k3k4);
+        x1=fold(x1,x2,k);
+        x1=fold(x1,x3,k);
+        x1=fold(x1,x4,k);
+        for(; size >= 16; size-=16, data+=16)
+            x1=fold(x1,_mm_loadu_si128((const __m128i*)data),k);
+        //128 -> 64 bits
+        __m128i mask=_mm_setr_epi32(~0,0,~0,0);
+        x2=_mm_clmulepi64_si128(x1,k,0x10);
+        x1=_mm_xor_si128(_mm_srli_si128(x1,8),x2);
+        k=_mm_loadl_epi64((const __m128i*)k5k0);
+        x2=_mm_srli_si128(x1,4);
+        x1=_mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1,mask),k,0x00),x2);
+        //Barrett reduction to 32 bits
+        k=_mm_load_si128((const __m128i*)poly);
+        x2=_mm_clmulepi64_si128(_mm_and_si128(x1,mask),k,0x10);
+        x2=_mm_clmulepi64_si128(_mm_and_si128(x2,mask),k,0x00);
+        crc=(quint32)_mm_extract_epi32(_mm_xor_si128(x1,x2),1);
+        return bytewise(crc,data,tail);
+    }
+    CRC32_TARGET_CLMUL inline static __m128i fold(__m128i x,__m128i next,__m128i k)
+    {
+        __m128i low=_mm_clmulepi64_si128(x,k,0x00);
+        return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x,k,0x11),next),low);
+    }
+#endif
+#ifdef CRC32_ARM
+    CRC32_TARGET_ARM inline static quint32 armv8(quint32 crc,const uchar *data,qint64 size)
+    {
+        for(; size > 0 && (quintptr(data)&7); size--)
+            crc=__crc32b(crc,*data++);
+        for(; size >= 32; size-=32, data+=32)
+        {
+            crc=__crc32d(crc,qFromLittleEndian<quint64>(data));
+            crc=__crc32d(crc,qFromLittleEndian<quint64>(data+8));
+            crc=__crc32d(crc,qFromLittleEndian<quint64>(data+16));
+            crc=__crc32d(crc,qFromLittleEndian<quint64>(data+24));
+        }
+        for(; size >= 8; size-=8, data+=8)
+            crc=__crc32d(crc,qFromLittleEndian<quint64>(data));
+        while(size-- > 0)
+            crc=__crc32b(crc,*data++);
+        return crc;
+    }
+#endif
+private:
+    inline static constexpr crc32tables tables=makeCrc32Tables();
+
+    struct choice
+    {
+        implementation update;
+        const char *name;
+    };
+    inline static const choice &selected()
+    {
+        static const choice chosen=detect();
+        return chosen;
+    }
+    inline static choice detect()
+    {
+#ifdef CRC32_X86
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info,1);
+        bool hasclmul=(info[2]&(1 << 1)) && (info[2]&(1 << 19));
+#else
+        bool hasclmul=__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+        if(hasclmul)
+            return {&crc32engine::clmul,"pclmulqdq"};
+#endif
+#ifdef CRC32_ARM
+#ifdef __ARM_FEATURE_CRC32
+        return {&crc32engine::armv8,"armv8 crc32"};
+#else
+        if(getauxval(AT_HWCAP)&HWCAP_CRC32)
+            return {&crc32engine::armv8,"armv8 crc32"};
+#endif
+#endif
+        return {&crc32engine::slicing8,"slicing-by-8"};
+    }
+
+    //Polynomial arithmetic modulo the crc polynomial (bit reflected), as used by zlib's crc32_combine
+    inline static quint32 multiply(quint32 a,quint32 b)
+    {
+        quint32 m=1u << 31,p=0;
+        for(;;)
+        {
+            if(a&m)
+            {
+                p^=b;
+                if((a&(m-1))==0) break;
+            }
+            m>>=1;
+            b=(b&1 ? (b >> 1)^polynomial : b >> 1);
+        }
+        return p;
+    }
+    //x^(8*bytes) modulo the polynomial by squaring
+    inline static quint32 xPow8n(qint64 bytes)
+    {
+        quint32 result=1u << 31,power=1u << 23; //x^0 and x^8
+        for(quint64 n=quint64(bytes); n; n>>=1)
+        {
+            if(n&1)
+                result=multiply(power,result);
+            power=multiply(power,power);
+        }
+        return result;
+    }
+};
+
+#endif // CRC32_H
@@ -12,9 +12,17 @@
 #include <QFile>
 #include <memory>
 #include <vector>
+#include <chrono>
+#include <algorithm>
+#include <climits>
+#include <tuple>
+#include <deque>
 #include "suspendable.h"
 #include "json.hpp"
 #include "httpsclient.h"
+#include "ratelimiter.h"
+#include "mpmcqueue.h"
+#include "fasthash.h"
 
 template<class T> using ptr=std::unique_ptr<T>;
 template<class T> using sptr=std::shared_ptr<T>;
@@ -183,13 +191,13 @@ public:
         string.replace("\\\"","\"");
         return string;
     }
-    inline static QString unquote(json &j)
+    inline static QString unquote(const json &j)
     {
         QString js=toQString(j);
         js.replace("\"","");
         return js;
     }
-    template<class T> inline static T to(json &j)
+    template<class T> inline static T to(const json &j)
     {
         T value;
         try
@@ -202,7 +210,7 @@ public:
         }
         return value;
     }
-    inline static QString toQString(json &j)
+    inline static QString toQString(const json &j)
     {
         QString js;
         try
@@ -215,6 +223,20 @@ public:
         }
         return js;
     }
+    //Walks object keys without inserting anything (unlike operator[]), a missing key gives null, so shared payloads stay untouched
+    inline static const json &at(const json &j,std::initializer_list<const char*> path)
+    {
+        static const json null;
+        const json *node=&j;
+        for(auto key : path)
+        {
+            if(!node->is_object()) return null;
+            auto it=node->find(key);
+            if(it==node->end()) return null;
+            node=&*it;
+        }
+        return *node;
+    }
     inline static json fromQString(QString js)
     {
         json j;
@@ -230,10 +252,186 @@ public:
     }
 };
 
+//What the GUILD_CREATE handler needs of each member and presence, a handful of strings instead of a DOM subtree apiece
+class guildroster
+{
+public:
+    class member
+    {
+    public:
+        QString id,username,discriminator,avatar;
+        bool isBot=false;
+    };
+    class presence
+    {
+    public:
+        QString id,status;
+    };
+    vec<member> members;
+    vec<presence> presences;
+};
+
+//j::fromQString for gateway payloads, except that a GUILD_CREATE's d.members and d.presences are read into a guildroster
+//record by record while parsing instead of becoming part of the DOM, for a big guild that's nearly all of the payload.
+//Discord sends "t" ahead of "d", a payload that doesn't is just parsed in full. Values are kept as j::unquote gives them.
+//Only nlohmann's public json_sax interface is used, the rest of the DOM is built here on a stack of open containers
+class gatewayparser : public nlohmann::json_sax<json>
+{
+private:
+    enum section { NONE, MEMBERS, PRESENCES };
+    json &root;
+    vec<json*> open; //Objects/arrays being filled, innermost last. Only the innermost ever grows, so the pointers hold
+    guildroster &roster;
+    int depth=0,rosterdepth=0; //Nesting of the container being read, and of the members/presences array when inside one
+    section current=NONE;
+    std::string lastkey,recordkey; //Last key read, and the key of the record field being read (e.g. "user")
+    bool readingtype=false,guildcreate=false;
+    gatewayparser(json &result,guildroster &target) : root(result),roster(target) { }
+    //Puts a value where the parse is, under the last key when the innermost container is an object
+    json *add(json &&value)
+    {
+        if(open.empty())
+        {
+            root=std::move(value);
+            return &root;
+        }
+        json &parent=*open.back();
+        if(parent.is_array())
+        {
+            parent.push_back(std::move(value));
+            return &parent.back();
+        }
+        json &slot=parent[lastkey];
+        slot=std::move(value);
+        return &slot;
+    }
+    bool scalar(json &&value)
+    {
+        if(current!=NONE)
+            field(value);
+        else
+            add(std::move(value));
+        return true;
+    }
+    void field(const json &value)
+    {
+        QString v=j::unquote(value);
+        if(current==MEMBERS && depth==rosterdepth+2 && recordkey=="user")
+        {
+            auto &m=roster.members.back();
+            if(lastkey=="id") m.id=v;
+            else if(lastkey=="username") m.username=v;
+            else if(lastkey=="discriminator") m.discriminator=v;
+            else if(lastkey=="avatar") m.avatar=v;
+            else if(lastkey=="bot") m.isBot=value.is_boolean() && value.get<bool>();
+        }
+        else if(current==PRESENCES && depth==rosterdepth+2 && recordkey=="user" && lastkey=="id")
+            roster.presences.back().id=v;
+        else if(current==PRESENCES && depth==rosterdepth+1 && lastkey=="status")
+            roster.presences.back().status=v;
+    }
+public:
+    bool streamed=false; //The roster got the members and presences, they aren't in the result
+    //A null json on a parse error, like j::fromQString
+    inline static json parse(const QString &text,guildroster &roster,bool *streamed=nullptr)
+    {
+        json result;
+        gatewayparser parser(result,roster);
+        QByteArray utf8=text.toUtf8();
+        if(!json::sax_parse(utf8.constData(),utf8.constData()+utf8.size(),&parser))
+            result=json();
+        if(streamed) *streamed=parser.streamed;
+        return result;
+    }
+    bool null() override { return scalar(nullptr); }
+    bool boolean(bool val) override { return scalar(val); }
+    bool number_integer(number_integer_t val) override { return scalar(val); }
+    bool number_unsigned(number_unsigned_t val) override { return scalar(val); }
+    bool number_float(number_float_t val,const string_t&) override { return scalar(val); }
+    bool string(string_t &val) override
+    {
+        if(current==NONE && readingtype)
+        {
+            guildcreate=(val=="GUILD_CREATE");
+            readingtype=false;
+        }
+        return scalar(std::move(val));
+    }
+    bool binary(binary_t&) override { return true; } //Only binary formats produce these, never json text
+    bool start_object(std::size_t) override
+    {
+        depth++;
+        if(current!=NONE)
+        {
+            if(depth==rosterdepth+1) //Next record
+            {
+                if(current==MEMBERS) roster.members.emplace_back();
+                else roster.presences.emplace_back();
+            }
+            else if(depth==rosterdepth+2)
+                recordkey=lastkey;
+            return true;
+        }
+        readingtype=false;
+        open.push_back(add(json::object()));
+        return true;
+    }
+    bool key(string_t &val) override
+    {
+        lastkey=val;
+        if(current==NONE)
+            readingtype=(depth==1 && val=="t");
+        return true;
+    }
+    bool end_object() override
+    {
+        depth--;
+        if(current!=NONE)
+        {
+            if(depth==rosterdepth+1) recordkey.clear();
+            return true;
+        }
+        open.pop_back();
+        return true;
+    }
+    bool start_array(std::size_t) override
+    {
+        depth++;
+        if(current!=NONE) return true;
+        readingtype=false;
+        if(guildcreate && depth==3 && (lastkey=="members" || lastkey=="presences")) //{"d":{"members":[
+        {
+            current=(lastkey=="members" ? MEMBERS : PRESENCES);
+            rosterdepth=depth;
+            streamed=true;
+            add(json::array()); //Leaves an empty array where they were
+            return true;
+        }
+        open.push_back(add(json::array()));
+        return true;
+    }
+    bool end_array() override
+    {
+        depth--;
+        if(current!=NONE)
+        {
+            if(depth==rosterdepth-1) current=NONE;
+            return true;
+        }
+        open.pop_back();
+        return true;
+    }
+    bool parse_error(std::size_t position,const std::string &last_token,const json::exception &ex) override
+    {
+        qDebug() << "json::parse_error:" << ex.what() << "at:" << position << "last token:" << last_token.c_str();
+        return false;
+    }
+};
+
 class botpaths
 {
 public:
-    QString botPath,messagesPath,usersPath,avatarsPath,avatarPath,configPath;
+    QString botPath,messagesPath,usersPath,avatarsPath,avatarPath,configPath,usersCachePath;
     botpaths() { }
     botpaths(QString bot_path)
     {
@@ -243,16 +441,23 @@ public:
         avatarsPath=bot_path+"/users/avatars";
         avatarPath=bot_path+"/bot_avatar.png";
         configPath=bot_path+"/bot_config.json";
+        usersCachePath=bot_path+"/users/users.json";
     }
+    QString sessionPath(quint32 shard) const { return QString(botPath+"/session_%1.json").arg(shard); }
 };
 
 class bot
 {
 public:
     botpaths botPaths;
-    QString botName,botKey;
+    QString botName,botKey,apiBase,gatewayUrl,trustedCert,gatewayEncoding; //Optional overrides, e.g. to run against a local mock server or use etf
+    QString shards; //Gateway shard count, or "auto" for discord's recommendation
+    QString intents,unhandledEvents; //Intents override (otherwise derived from the handlers), "drop" to not even archive unhandled events
     QByteArray bot_avatar,bot_config;
     bool tts=false;
+    bool workStealing=false; //Idle processing threads take events queued for other bots
+    QString commandHighWater,bulkHighWater,bulkOverflow; //Queued events per class before new ones are only archived, "drop" to discard bulk instead
+    QString record,replay,replaySpeed; //Gateway capture: "yes" or a file to record to, a capture to replay instead of connecting and its speed ("max" or a multiplier)
     void setPaths(QString bot_path)
     {
         botPaths=botpaths(bot_path);
@@ -279,6 +484,20 @@ public:
             botName=j::unquote(cfg["name"]);
             botKey=j::unquote(cfg["key"]);
             tts=(j::unquote(cfg["tts"])=="yes");
+            apiBase=j::unquote(cfg["api_base"]);
+            gatewayUrl=j::unquote(cfg["gateway"]);
+            trustedCert=j::unquote(cfg["trusted_cert"]);
+            gatewayEncoding=j::unquote(cfg["encoding"]);
+            shards=j::unquote(cfg["shards"]);
+            intents=j::unquote(cfg["intents"]);
+            unhandledEvents=j::unquote(cfg["unhandled_events"]);
+            workStealing=(j::unquote(cfg["work_stealing"])=="yes");
+            commandHighWater=j::unquote(cfg["command_high_water"]);
+            bulkHighWater=j::unquote(cfg["bulk_high_water"]);
+            bulkOverflow=j::unquote(cfg["bulk_overflow"]);
+            record=j::unquote(cfg["record"]);
+            replay=j::unquote(cfg["replay"]);
+            replaySpeed=j::unquote(cfg["replay_speed"]);
             qDebug() << "Loaded:" << botName << botKey << tts;
         }
         if(isNotEmptyOrNull(botPaths.avatarPath)) bot_avatar=fileRead(botPaths.avatarPath);
@@ -287,6 +506,20 @@ public:
     {
         QString botcfg=QString(R"({"name":"%1","key":"%2","tts":"%3"})").arg(botName).arg(botKey).arg(tts ? "yes" : "no");
         json cfg=j::fromQString(botcfg);
+        if(isNotEmptyOrNull(apiBase)) cfg["api_base"]=apiBase.toStdString();
+        if(isNotEmptyOrNull(gatewayUrl)) cfg["gateway"]=gatewayUrl.toStdString();
+        if(isNotEmptyOrNull(trustedCert)) cfg["trusted_cert"]=trustedCert.toStdString();
+        if(isNotEmptyOrNull(gatewayEncoding)) cfg["encoding"]=gatewayEncoding.toStdString();
+        if(isNotEmptyOrNull(shards)) cfg["shards"]=shards.toStdString();
+        if(isNotEmptyOrNull(intents)) cfg["intents"]=intents.toStdString();
+        if(isNotEmptyOrNull(unhandledEvents)) cfg["unhandled_events"]=unhandledEvents.toStdString();
+        if(workStealing) cfg["work_stealing"]="yes";
+        if(isNotEmptyOrNull(commandHighWater)) cfg["command_high_water"]=commandHighWater.toStdString();
+        if(isNotEmptyOrNull(bulkHighWater)) cfg["bulk_high_water"]=bulkHighWater.toStdString();
+        if(isNotEmptyOrNull(bulkOverflow)) cfg["bulk_overflow"]=bulkOverflow.toStdString();
+        if(isNotEmptyOrNull(record)) cfg["record"]=record.toStdString();
+        if(isNotEmptyOrNull(replay)) cfg["replay"]=replay.toStdString();
+        if(isNotEmptyOrNull(replaySpeed)) cfg["replay_speed"]=replaySpeed.toStdString();
         QString bot_config=j::toQString(cfg);
         qDebug() << "bot_config:" << bot_config;
         fileWrite(bot_config.toUtf8(),config_path);
@@ -430,7 +663,7 @@ public:
     {
         qint64 numBots=bots.size();
         thread_allowance=concurrency/numBots;
-        if(thread_allowance < 0)
+        if(thread_allowance < 1)
             thread_allowance=1;
         qDebug() << "Thread allowance:" << thread_allowance;
     }
@@ -579,23 +812,21 @@ public:
         if(bot::isEmptyOrNull(id) || bot::isEmptyOrNull(avatar)) return;
         qDebug() << "avatarsPath:" << avatarsPath;
         loadAvatarImageFromFile(avatarsPath);
-        if(avatarImage.size()==0 || QRandomGenerator().bounded(1,10)==10)
+        //Goes through httpscache, an avatar we already have costs a revalidation (or nothing while still fresh)
+        httpsclient https;
+        QString avatar_url=bot_instances::avatarsUrl.arg(id).arg(avatar);
+        auto response=https.send(httpsrequest(httpsrequest::type::GET,avatar_url));
+        if(response.success && !response.content.isEmpty())
         {
-            httpsclient https;
-            QString avatar_url=bot_instances::avatarsUrl.arg(id).arg(avatar);
-            auto response=https.send(httpsrequest(httpsrequest::type::GET,avatar_url));
-            if(response.success && !response.content.isEmpty())
+            QByteArray newAvatarImage=response.content;
+            QByteArray newAvatarHash=QCryptographicHash::hash(newAvatarImage,QCryptographicHash::Sha256);
+            if(newAvatarHash != avatarHash)
             {
-                QByteArray newAvatarImage=response.content;
-                QByteArray newAvatarHash=QCryptographicHash::hash(newAvatarImage,QCryptographicHash::Sha256);
-                if(newAvatarHash != avatarHash)
-                {
-                    QString avatarPath=(avatarsPath+"/%1.png").arg(id);
-                    bot::fileWrite(newAvatarImage,avatarPath);
-                    avatarImage=newAvatarImage;
-                    avatarHash=newAvatarHash;
-                    qDebug() << "Wrote new avatar image to disk for user:" << name << "size:" << avatarImage.size() << "path:" << avatarPath << "url:" << avatar_url;
-                }
+                QString avatarPath=(avatarsPath+"/%1.png").arg(id);
+                bot::fileWrite(newAvatarImage,avatarPath);
+                avatarImage=newAvatarImage;
+                avatarHash=newAvatarHash;
+                qDebug() << "Wrote new avatar image to disk for user:" << name << "size:" << avatarImage.size() << "path:" << avatarPath << "url:" << avatar_url;
             }
         }
     }
@@ -605,32 +836,83 @@ class discordusers
 {
 public:
     vec<discorduser> users;
+    json self; //The bot's own user from READY, a resumed session never gets another READY
     botpaths botPaths;
     QMutex mutex;
+    std::atomic<bool> changed=false; //Since the last snapshot
     discordusers() { }
     ~discordusers() { }
-    bool updateStatusForUser(json &j)
+    //Snapshot of the user cache so a restart that resumes its session starts out knowing everyone
+    bool save()
+    {
+        json snapshot={{"self",nullptr},{"users",json::array()}};
+        {
+            QMutexLocker locker(&mutex);
+            snapshot["self"]=self;
+            for(auto &usr : users)
+            {
+                snapshot["users"].push_back({{"id",usr.id.toStdString()},{"name",usr.name.toStdString()},{"discriminator",usr.discriminator.toStdString()},
+                                             {"avatar",usr.avatar.toStdString()},{"last_channel_id",usr.last_channel_id.toStdString()},
+                                             {"last_guild_id",usr.last_guild_id.toStdString()},{"status",usr.status.toStdString()},{"bot",usr.isBot}});
+            }
+            changed=false;
+        }
+        return bot::fileWrite(j::toQString(snapshot).toUtf8(),botPaths.usersCachePath);
+    }
+    //Avatars come from the files already on disk, nothing is downloaded
+    bool load()
+    {
+        bool successful=false;
+        QByteArray saved=bot::fileRead(botPaths.usersCachePath,&successful);
+        if(!successful)
+            return false;
+        json snapshot=j::fromQString(saved);
+        QMutexLocker locker(&mutex);
+        self=j::at(snapshot,{"self"});
+        users.clear();
+        for(auto &u : j::at(snapshot,{"users"}))
+        {
+            discorduser user;
+            user.id=j::unquote(j::at(u,{"id"}));
+            user.name=j::unquote(j::at(u,{"name"}));
+            user.discriminator=j::unquote(j::at(u,{"discriminator"}));
+            user.avatar=j::unquote(j::at(u,{"avatar"}));
+            user.last_channel_id=j::unquote(j::at(u,{"last_channel_id"}));
+            user.last_guild_id=j::unquote(j::at(u,{"last_guild_id"}));
+            user.status=j::unquote(j::at(u,{"status"}));
+            user.isBot=j::to<bool>(j::at(u,{"bot"}));
+            user.loadAvatarImageFromFile(botPaths.avatarsPath);
+            user.calculateHash();
+            users.push_back(user);
+        }
+        qDebug() << "Loaded" << users.size() << "cached users from:" << botPaths.usersCachePath;
+        return true;
+    }
+    bool updateStatusForUser(const json &j)
+    {
+        return updateStatusForUser(j::unquote(j::at(j,{"user","id"})),j::unquote(j::at(j,{"status"})));
+    }
+    bool updateStatusForUser(const QString &userid,const QString &status)
     {
         QMutexLocker locker(&mutex);
-        QString userid=j::unquote(j["user"]["id"]);
-        QString status=j::unquote(j["status"]);
         for(auto &usr : users)
         {
             if(usr.id==userid)
             {
                 usr.status=status;
+                changed=true;
                 qDebug() << "Present user:" << userid << "status:" << status;
                 return true;
             }
         }
         return false;
     }
-    discorduser updateStreamingStatusForUser(json &j)
+    discorduser updateStreamingStatusForUser(const json &j)
     {
         QMutexLocker locker(&mutex);
-        QString userid=j::unquote(j["member"]["user"]["id"]);
-        QString streamingStatus=j::unquote(j["self_stream"]);
-        QString onCameraStatus=j::unquote(j["self_video"]);
+        QString userid=j::unquote(j::at(j,{"member","user","id"}));
+        QString streamingStatus=j::unquote(j::at(j,{"self_stream"}));
+        QString onCameraStatus=j::unquote(j::at(j,{"self_video"}));
         qDebug() << "1Voice state update user:" << userid << "streaming:" << streamingStatus << "on camera:" << onCameraStatus;
         for(auto &usr : users)
         {
@@ -638,6 +920,7 @@ public:
             {
                 usr.isStreaming=streamingStatus=="true" ? true : false;
                 usr.onCamera=onCameraStatus=="true" ? true : false;
+                changed=true;
                 qDebug() << "2Voice state update user:" << userid << "streaming:" << streamingStatus << "on camera:" << onCameraStatus;
                 discorduser u=usr;
                 return u;
@@ -645,43 +928,61 @@ public:
         }
         return discorduser();
     }
-    discorduser addUserFromGuildCreate(json &j)
+    discorduser addUserFromGuildCreate(const json &j)
+    {
+        const json &u=j::at(j,{"user"});
+        guildroster::member member;
+        member.id=j::unquote(j::at(u,{"id"}));
+        member.username=j::unquote(j::at(u,{"username"}));
+        member.discriminator=j::unquote(j::at(u,{"discriminator"}));
+        member.avatar=j::unquote(j::at(u,{"avatar"}));
+        if(j::at(u,{"bot"}) != nullptr)
+            member.isBot=j::to<bool>(j::at(u,{"bot"}));
+        return addUserFromGuildCreate(member);
+    }
+    discorduser addUserFromGuildCreate(const guildroster::member &member)
     {
         QMutexLocker locker(&mutex);
         discorduser user;
-        QString avatar=j::unquote(j["user"]["avatar"]);
-        user.id=j::unquote(j["user"]["id"]);
+        const QString &avatar=member.avatar;
+        user.id=member.id;
         for(auto &usr : users)
         {
             if(usr.id==user.id)
             {
-                //Update user's avatar in cased changed
-                usr.avatar=avatar;
-                usr.downloadAvatarImage(botPaths.avatarsPath);
+                //Update user's avatar in case it changed, cached users already have theirs
+                if(usr.avatar != avatar || usr.avatarImage.isEmpty())
+                {
+                    usr.avatar=avatar;
+                    usr.downloadAvatarImage(botPaths.avatarsPath);
+                    changed=true;
+                }
                 user=usr;
                 qDebug() << "[GUILD_CREATE] updated member:" << user.name << user.discriminator << "id: "<< user.id << "avatar:" << avatar << "avatar image size:" << user.avatarImage.size();
                 return user;
             }
         }
         //Haven't seen this user before, add them from this guild create message
-        user.name=j::unquote(j["user"]["username"]);
-        user.discriminator=j::unquote(j["user"]["discriminator"]);
-        user.avatar=j::unquote(j["user"]["avatar"]);
+        user.name=member.username;
+        user.discriminator=member.discriminator;
+        user.avatar=avatar;
         user.downloadAvatarImage(botPaths.avatarsPath);
-        bool isBot=false;
-        if(j["user"]["bot"] != nullptr)
-            isBot=j::to<bool>(j["user"]["bot"]);
+        bool isBot=member.isBot;
+        user.isBot=isBot;
+        user.calculateHash();
         users.push_back(user);
+        changed=true;
         qDebug() << "[GUILD_CREATE] member:" << user.name << user.discriminator << "id:" << user.id << "avatar:" << avatar << "bot:" << isBot;
         return user;
     }
-    discorduser addUserFromMessage(json &j)
+    discorduser addUserFromMessage(const json &j)
     {
         QMutexLocker locker(&mutex);
         discorduser user;
-        QString channel=j::unquote(j["d"]["channel_id"]);
-        QString avatar=j::unquote(j["d"]["author"]["avatar"]);
-        user.id=j::unquote(j["d"]["author"]["id"]);
+        const json &author=j::at(j,{"d","author"});
+        QString channel=j::unquote(j::at(j,{"d","channel_id"}));
+        QString avatar=j::unquote(j::at(author,{"avatar"}));
+        user.id=j::unquote(j::at(author,{"id"}));
         for(auto &usr : users)
         {
             if(usr.id==user.id)
@@ -695,47 +996,75 @@ public:
                     usr.downloadAvatarImage(botPaths.avatarsPath);
                 }
                 user=usr;
+                changed=true;
                 qDebug() << "[MESSAGE_CREATE] Updated user from message create:" << usr.name << usr.discriminator << "id:" << usr.id << "avatar:" << usr.avatar << "avatar image size:" << usr.avatarImage.size();
                 return user;
             }
         }
         //Haven't seen this user before, add them from this discord message
-        user.name=j::unquote(j["d"]["author"]["username"]);
-        user.discriminator=j::unquote(j["d"]["author"]["discriminator"]);
+        user.name=j::unquote(j::at(author,{"username"}));
+        user.discriminator=j::unquote(j::at(author,{"discriminator"}));
         user.avatar=avatar;
         user.last_channel_id=channel;
         user.downloadAvatarImage(botPaths.avatarsPath);
         user.calculateHash();
         users.push_back(user);
+        changed=true;
         qDebug() << "[MESSAGE_CREATE] Added user from message create:" << user.name << user.discriminator << "id:" << user.id << "avatar:" << user.avatar << "avatar image size:" << user.avatarImage.size();
         return user;
     }
 };
 
+//One gateway event, parsed once and never modified afterwards, the queue, handlers and message log all share it as a discordevent
 class discordmessage
 {
 public:
     json jsonmsg;
-    QString stringmsg,cmd,usercmd,channel_id,usermsg;
-    QByteArray cmd_id_hash,usercmd_id_hash,msg_hash;
+    sptr<const guildroster> roster; //A GUILD_CREATE's members and presences when they were streamed out of jsonmsg
+    QString cmd,usercmd,channel_id,usermsg;
+    //Processing order between classes: gateway control first, then what users are waiting on, then bulk state
+    enum priority : quint8 { CONTROL, COMMAND, BULK };
+    static constexpr int priorities=3;
+    priority priorityclass=CONTROL;
+    QString lane; //Events sharing a lane (priority class plus channel, else guild, else the gateway itself) are handled one at a time in order
+    quint64 cmd_id_hash=0,usercmd_id_hash=0,msg_hash=0; //fasthash of t+op, the user command+op and the raw payload
     QDateTime createdAt;
-    uint32_t id=0,completed=0;
-    bool handledDiscordCommand=false,handledUserCommand=false,hasUserCommand=false;
-    discordmessage(QString message)
-    {
-        if(message.isEmpty())
+    std::chrono::steady_clock::time_point received=std::chrono::steady_clock::now(); //For the queue pickup latency
+    uint32_t id=0;
+    quint32 shard=0; //Gateway shard the event arrived on
+    bool hasUserCommand=false;
+    discordmessage(QString message) : discordmessage(message.isEmpty() ? json() : j::fromQString(message),fasthash::of(message)) { }
+    //From an already parsed payload and the hash of the frame it came from (json text or etf bytes),
+    //archive only events just keep the payload for the message log, no command parsing or hashing
+    discordmessage(json message,quint64 payloadhash,quint32 shardId=0,bool archiveonly=false,sptr<const guildroster> streamed=nullptr)
+        : roster(std::move(streamed)),msg_hash(payloadhash),shard(shardId)
+    {
+        if(message.is_null())
             return;
         createdAt=QDateTime::currentDateTime();
-        jsonmsg=j::fromQString(message);
-        stringmsg=message;
-        id=j::to<uint32_t>(jsonmsg["op"]);
-        cmd=j::unquote(jsonmsg["t"]);
-        if(jsonmsg["d"]!=nullptr)
-        {
-            auto d=jsonmsg["d"];
-            usermsg=j::unquote(d["content"]);
-            channel_id=j::unquote(d["channel_id"]);
-        }
+        jsonmsg=std::move(message);
+        id=j::to<uint32_t>(j::at(jsonmsg,{"op"}));
+        cmd=j::unquote(j::at(jsonmsg,{"t"}));
+        if(archiveonly)
+            return;
+        const json &d=j::at(jsonmsg,{"d"});
+        if(d!=nullptr)
+        {
+            usermsg=j::unquote(j::at(d,{"content"}));
+            channel_id=j::unquote(j::at(d,{"channel_id"}));
+            QString guild_id=j::unquote(j::at(d,{"guild_id"}));
+            if(bot::isNotEmptyOrNull(channel_id))
+                lane="channel:"+channel_id;
+            else if(bot::isNotEmptyOrNull(guild_id))
+                lane="guild:"+guild_id;
+        }
+        if(id!=0 || cmd=="READY" || cmd=="RESUMED")
+            priorityclass=CONTROL;
+        else if(cmd.startsWith("MESSAGE_") || cmd.startsWith("INTERACTION_"))
+            priorityclass=COMMAND;
+        else
+            priorityclass=BULK;
+        lane=QString("%1/%2").arg(priorityName(priorityclass)).arg(lane.isEmpty() ? "gateway" : lane);
         if(usermsg.contains(" "))
             usercmd=usermsg.split(" ",Qt::SkipEmptyParts)[0].toLower();
         else
@@ -743,98 +1072,470 @@ public:
         hasUserCommand=(id==0 && cmd=="MESSAGE_CREATE" && usercmd != "null");
         calculateHashes();
     }
+    inline static QString priorityName(int p) { return (p==CONTROL ? "control" : p==COMMAND ? "command" : "bulk"); }
+    inline static std::shared_ptr<const discordmessage> archiveOnly(json message,quint32 shard)
+    {
+        return std::make_shared<const discordmessage>(std::move(message),0,shard,true);
+    }
+    //The op seeds the hash so t/command and op need no joined string
+    inline static quint64 commandHash(const QString &cmd,quint32 op) { return fasthash::of(cmd,op); }
     void calculateHashes()
     {
-        QString hashCommandId=QString("%1+%2").arg(cmd).arg(id);
-        QString hashUserCommandId=QString("%1+%2").arg(usercmd).arg(id);
-        msg_hash=QCryptographicHash::hash(stringmsg.toUtf8(),QCryptographicHash::Sha256);
-        cmd_id_hash=QCryptographicHash::hash(hashCommandId.toUtf8(),QCryptographicHash::Sha256);
+        cmd_id_hash=commandHash(cmd,id);
         if(hasUserCommand)
-            usercmd_id_hash=QCryptographicHash::hash(hashUserCommandId.toUtf8(),QCryptographicHash::Sha256);
-        //qDebug() << "message op:" << id << "cmd:" << cmd << "usercmd:" << usercmd << "cmd_id_hash:" << cmd_id_hash.toHex() << "usercmd_id_hash:" << usercmd_id_hash.toHex();
+            usercmd_id_hash=commandHash(usercmd,id);
+        //qDebug() << "message op:" << id << "cmd:" << cmd << "usercmd:" << usercmd << "cmd_id_hash:" << cmd_id_hash << "usercmd_id_hash:" << usercmd_id_hash;
     }
 };
+using discordevent=sptr<const discordmessage>;
 
 class command
 {
 public:
     QString cmd;
     quint32 op;
-    QByteArray cmd_id_hash;
-    std::function<void(discordmessage&)> func;
+    quint64 cmd_id_hash=0;
+    std::function<void(const discordmessage&)> func;
     bool isUserCommand=false;
     command() { }
-    command(QString cmd,quint32 op,std::function<void(discordmessage&)> func,bool isUserCommand=false)
+    command(QString cmd,quint32 op,std::function<void(const discordmessage&)> func,bool isUserCommand=false)
     {
         this->cmd=cmd.toLower();
         this->op=op;
         this->func=func;
         this->isUserCommand=isUserCommand;
-        QString hashCommandId=QString("%1+%2").arg(cmd).arg(op);
-        cmd_id_hash = QCryptographicHash::hash(hashCommandId.toUtf8(),QCryptographicHash::Sha256);
-        qDebug() << "Generated hash:" << cmd_id_hash.toHex() << "from command:" << cmd << "op:" << op;
-    }
-    bool operator==(discordmessage &msg)
-    {            
-        if(!isUserCommand && msg.cmd_id_hash==cmd_id_hash && !msg.handledDiscordCommand)
-            return msg.handledDiscordCommand=++msg.completed;
-        else if(isUserCommand && msg.usercmd_id_hash==cmd_id_hash && !msg.handledUserCommand)
-            return msg.handledUserCommand=++msg.completed;
-        return false;
+        cmd_id_hash=discordmessage::commandHash(cmd,op);
+        qDebug() << "Generated hash:" << QString::number(cmd_id_hash,16) << "from command:" << cmd << "op:" << op;
+    }
+    bool operator==(const discordmessage &msg) const
+    {
+        if(!isUserCommand)
+            return msg.cmd_id_hash==cmd_id_hash;
+        return msg.hasUserCommand && msg.usercmd_id_hash==cmd_id_hash;
     }
 };
 
+//Commands indexed by their hash, every handler registered for the same command shares one list
+//so routing an event is a single lookup however many commands there are
 class commandarray
 {
 public:
-    vec<command> cmds;
+    QHash<quint64,vec<command>> cmds;
+    size_t count=0;
+    void add(command cmd)
+    {
+        cmds[cmd.cmd_id_hash].push_back(std::move(cmd));
+        count++;
+    }
+    const vec<command>* find(quint64 hash) const
+    {
+        auto it=cmds.constFind(hash);
+        return (it==cmds.constEnd() ? nullptr : &it.value());
+    }
 };
 
+//Registered before the processing threads start and only read afterwards, so lookups need no lock
 class commands : public Singleton<commands>
 {
 public:
-    vec<commandarray> cmds;
+    commandarray discord; //Keyed by t+op
+    commandarray custom; //Keyed by the first word of a message (lower case)+op
     std::atomic<bool> commandsadded=false;
 
-    commands()
-    {
-        commandarray commands;
-        cmds.push_back(commands); //Discord commands array
-        cmds.push_back(commands); //Custom commands array
-    }
+    commands() { }
     ~commands() { }
     commands(commands&)=delete;
     void operator=(commands&)=delete;
-    inline static void onDiscord(QString cmd,uint32_t id,std::function<void(discordmessage&)> func)
+    inline static void onDiscord(QString cmd,uint32_t id,std::function<void(const discordmessage&)> func)
+    {
+        get()->discord.add(command(cmd,id,func));
+    }
+    inline static void onCustom(QString cmd,uint32_t id,std::function<void(const discordmessage&)> func)
+    {
+        get()->custom.add(command(cmd,id,func,true));
+    }
+    //Runs every handler registered for the event, returns how many ran
+    inline static int dispatch(const discordmessage &event)
     {
         auto commands=get();
-        commandarray *cmdarray=&commands->cmds.at(0);
-        if(cmdarray!=nullptr)
-            cmdarray->cmds.push_back(command(cmd,id,func));
+        int executed=0;
+        if(auto handlers=commands->discord.find(event.cmd_id_hash))
+        {
+            for(auto &cmd : *handlers)
+                cmd.func(event);
+            executed+=handlers->size();
+            qDebug() << "Executed" << handlers->size() << "matched discord command(s) with cmd_id_hash:" << QString::number(event.cmd_id_hash,16);
+        }
+        if(event.hasUserCommand)
+        {
+            if(auto handlers=commands->custom.find(event.usercmd_id_hash))
+            {
+                for(auto &cmd : *handlers)
+                    cmd.func(event);
+                executed+=handlers->size();
+                qDebug() << "Executed" << handlers->size() << "matched user command(s) with usercmd_id_hash:" << QString::number(event.usercmd_id_hash,16);
+            }
+        }
+        return executed;
     }
-    inline static void onCustom(QString cmd,uint32_t id,std::function<void(discordmessage&)> func)
+    //Dispatch event names something is registered for, user commands need MESSAGE_CREATE
+    inline static QSet<QString> handledEvents()
     {
         auto commands=get();
-        commandarray *cmdarray=&commands->cmds.at(1);
-        if(cmdarray!=nullptr)
-            cmdarray->cmds.push_back(command(cmd,id,func,true));
+        QSet<QString> events;
+        for(auto &handlers : commands->discord.cmds)
+            for(auto &cmd : handlers)
+                if(cmd.op==0) events.insert(cmd.cmd.toUpper());
+        if(commands->custom.count > 0)
+            events.insert("MESSAGE_CREATE");
+        return events;
     }
     inline static void setCommandsAdded() { get()->commandsadded=true; }
     inline static bool commandsAdded() { return get()->commandsadded; }
 };
 
+//Gateway intent bits and the dispatch events each one turns on
+class gatewayintents
+{
+public:
+    enum intent : quint32
+    {
+        GUILDS=1 << 0,
+        GUILD_MEMBERS=1 << 1, //Privileged
+        GUILD_BANS=1 << 2,
+        GUILD_EMOJIS=1 << 3,
+        GUILD_INTEGRATIONS=1 << 4,
+        GUILD_WEBHOOKS=1 << 5,
+        GUILD_INVITES=1 << 6,
+        GUILD_VOICE_STATES=1 << 7,
+        GUILD_PRESENCES=1 << 8, //Privileged
+        GUILD_MESSAGES=1 << 9,
+        GUILD_MESSAGE_REACTIONS=1 << 10,
+        GUILD_MESSAGE_TYPING=1 << 11,
+        DIRECT_MESSAGES=1 << 12,
+        DIRECT_MESSAGE_REACTIONS=1 << 13,
+        DIRECT_MESSAGE_TYPING=1 << 14,
+    };
+    inline static quint32 forEvent(const QString &event)
+    {
+        static const QHash<QString,quint32> intents=
+        {
+            {"GUILD_CREATE",GUILDS},{"GUILD_UPDATE",GUILDS},{"GUILD_DELETE",GUILDS},
+            {"GUILD_ROLE_CREATE",GUILDS},{"GUILD_ROLE_UPDATE",GUILDS},{"GUILD_ROLE_DELETE",GUILDS},
+            {"CHANNEL_CREATE",GUILDS},{"CHANNEL_UPDATE",GUILDS},{"CHANNEL_DELETE",GUILDS},{"CHANNEL_PINS_UPDATE",GUILDS|DIRECT_MESSAGES},
+            {"GUILD_MEMBER_ADD",GUILD_MEMBERS},{"GUILD_MEMBER_UPDATE",GUILD_MEMBERS},{"GUILD_MEMBER_REMOVE",GUILD_MEMBERS},
+            {"GUILD_BAN_ADD",GUILD_BANS},{"GUILD_BAN_REMOVE",GUILD_BANS},
+            {"GUILD_EMOJIS_UPDATE",GUILD_EMOJIS},
+            {"GUILD_INTEGRATIONS_UPDATE",GUILD_INTEGRATIONS},
+            {"WEBHOOKS_UPDATE",GUILD_WEBHOOKS},
+            {"INVITE_CREATE",GUILD_INVITES},{"INVITE_DELETE",GUILD_INVITES},
+            {"VOICE_STATE_UPDATE",GUILD_VOICE_STATES},
+            {"PRESENCE_UPDATE",GUILD_PRESENCES},
+            {"MESSAGE_CREATE",GUILD_MESSAGES|DIRECT_MESSAGES},{"MESSAGE_UPDATE",GUILD_MESSAGES|DIRECT_MESSAGES},
+            {"MESSAGE_DELETE",GUILD_MESSAGES|DIRECT_MESSAGES},{"MESSAGE_DELETE_BULK",GUILD_MESSAGES},
+            {"MESSAGE_REACTION_ADD",GUILD_MESSAGE_REACTIONS|DIRECT_MESSAGE_REACTIONS},
+            {"MESSAGE_REACTION_REMOVE",GUILD_MESSAGE_REACTIONS|DIRECT_MESSAGE_REACTIONS},
+            {"MESSAGE_REACTION_REMOVE_ALL",GUILD_MESSAGE_REACTIONS|DIRECT_MESSAGE_REACTIONS},
+            {"TYPING_START",GUILD_MESSAGE_TYPING|DIRECT_MESSAGE_TYPING},
+        };
+        return intents.value(event,0);
+    }
+    //Just the intents the registered handlers need, GUILDS always since the bot needs its guilds to function
+    inline static quint32 forEvents(const QSet<QString> &events)
+    {
+        quint32 intents=GUILDS;
+        for(auto &event : events)
+            intents|=forEvent(event);
+        return intents;
+    }
+};
+
+//A serial lane, at most one processing thread holds it (claimed) and takes its events front to back
+class eventlane
+{
+public:
+    QString key;
+    int priority=discordmessage::BULK; //Ready queue the lane goes in, a lane only ever holds one priority class
+    QMutex mutex;
+    std::deque<discordevent> pending;
+    bool claimed=false; //Waiting in the ready queue or being processed
+    qint64 lastactive=0;
+    std::atomic<quint64> processed=0;
+    size_t maxdepth=0;
+    eventlane(QString key,int priority) : key(key),priority(priority) { }
+};
+
+//Lanes by key, split over independently locked stripes so events for different channels hardly ever meet on a lock.
+//Lanes idle for longer than idleTimeout are swept out of their stripe now and then
+class eventlanes
+{
+private:
+    class stripe
+    {
+    public:
+        QMutex mutex;
+        QHash<QString,sptr<eventlane>> lanes;
+        quint64 pushes=0;
+    };
+    static constexpr int stripecount=64;
+    std::unique_ptr<stripe[]> stripes{new stripe[stripecount]};
+    void sweep(stripe &s,qint64 now)
+    {
+        for(auto it=s.lanes.begin(); it!=s.lanes.end();)
+        {
+            eventlane &lane=*it.value();
+            QMutexLocker locker(&lane.mutex);
+            bool idle=(!lane.claimed && lane.pending.empty() && lane.lastactive+idleTimeout <= now);
+            locker.unlock();
+            if(idle)
+                it=s.lanes.erase(it);
+            else
+                ++it;
+        }
+    }
+public:
+    inline static qint64 idleTimeout=10*60*1000;
+    //Appends to the event's lane, true when the lane was idle and now has to go in the ready queue.
+    //The stripe stays locked while appending so a sweep can never drop a lane that just got an event
+    bool push(discordevent event,sptr<eventlane> &lane)
+    {
+        stripe &s=stripes[qHash(event->lane)%stripecount];
+        QMutexLocker locker(&s.mutex);
+        qint64 now=QDateTime::currentMSecsSinceEpoch();
+        if(++s.pushes%1024==0)
+            sweep(s,now);
+        auto &slot=s.lanes[event->lane];
+        if(!slot)
+            slot=std::make_shared<eventlane>(event->lane,event->priorityclass);
+        lane=slot;
+        QMutexLocker lanelocker(&lane->mutex);
+        lane->pending.push_back(std::move(event));
+        lane->maxdepth=qMax(lane->maxdepth,lane->pending.size());
+        lane->lastactive=now;
+        if(lane->claimed)
+            return false;
+        lane->claimed=true;
+        return true;
+    }
+    //Lane count and the deepest lanes right now
+    QString report(int top=5)
+    {
+        vec<std::tuple<size_t,QString,size_t,quint64>> depths; //depth, key, max depth, processed
+        for(int i=0; i < stripecount; i++)
+        {
+            QMutexLocker locker(&stripes[i].mutex);
+            for(auto &lane : stripes[i].lanes)
+            {
+                QMutexLocker lanelocker(&lane->mutex);
+                depths.emplace_back(lane->pending.size(),lane->key,lane->maxdepth,lane->processed.load());
+            }
+        }
+        std::sort(depths.begin(),depths.end(),[](auto &a,auto &b){ return std::get<0>(a) > std::get<0>(b); });
+        QString r=QString("lanes: %1").arg(depths.size());
+        for(size_t i=0; i < depths.size() && i < (size_t)top; i++)
+        {
+            auto &[depth,key,maxdepth,processed]=depths[i];
+            r+=QString("\n  lane %1 depth: %2 max depth: %3 processed: %4").arg(key).arg(depth).arg(maxdepth).arg(processed);
+        }
+        return r;
+    }
+};
+
 class messagestorage : public QObject
 {
     Q_OBJECT
 public:
     inline static size_t writeMessagesThreshold=10;
     inline static qint64 nextLogMessagesDelay=60*1000; //Checks whether to write and does write every 60 seconds and if 10 or more completed messages exist...
-    vec<discordmessage> messagequeue,messagescompleted;
+    inline static size_t queueCapacity=1 << 16;
+    eventlanes lanes;
+    //Lanes with events and no thread on them yet by priority class, each is in here at most once
+    prioritympmcqueue<sptr<eventlane>,discordmessage::priorities> readylanes{queueCapacity};
+    std::atomic<size_t> queued=0; //Events waiting in lanes, at most queueCapacity so readylanes can't fill up
+    std::atomic<size_t> queuedclass[discordmessage::priorities]{};
+    //Per class high-water marks, above them new events of the class are only written to the message log (or dropped, for bulk with dropbulk).
+    //Bulk stops well short of the capacity so a reconnect storm leaves room for commands and control events
+    size_t highwater[discordmessage::priorities]={queueCapacity,queueCapacity,queueCapacity/4};
+    bool dropbulk=false;
+    std::atomic<quint64> overflowed=0,duplicates=0;
+    std::atomic<quint64> dropped[discordmessage::priorities]{},degraded[discordmessage::priorities]{};
+    std::atomic<quint64> pickups=0,pickupnanos=0,maxpickupnanos=0,stolen=0; //Time from an event arriving to a processing thread taking it
+    std::atomic<quint64> handled=0,handlernanos=0,maxhandlernanos=0,endtoendnanos=0,maxendtoendnanos=0; //Handler run time, and arrival to handlers done
+    vec<discordevent> messagescompleted;
+    QMutex completedmutex; //Guards messagescompleted, processing threads and the gateway both add to it
+    inline static qint64 dedupeWindow=5*60*1000; //How long a payload hash is remembered
+    QMutex recentmutex;
+    QHash<quint64,qint64> recent; //Payload hash -> when it was seen
+    std::deque<std::pair<qint64,quint64>> recentorder;
     QString botDirectory,outputDirectory,currentOutputPath;
     bool append=false;
     int lastWrittenDay=0;
+    inline static QMutex storagesmutex;
+    inline static vec<wptr<messagestorage>> storages; //Every bot's storage, for work stealing
     messagestorage() { }
     ~messagestorage() { }
+    inline static void addStorage(const sptr<messagestorage> &storage)
+    {
+        QMutexLocker locker(&storagesmutex);
+        storages.erase(std::remove_if(storages.begin(),storages.end(),[](const wptr<messagestorage> &s){ return s.expired(); }),storages.end());
+        storages.push_back(storage);
+    }
+    //Takes an event queued for another bot, from is the storage its lane has to be released and the event completed in
+    inline static bool steal(const messagestorage *own,sptr<eventlane> &lane,discordevent &event,sptr<messagestorage> &from)
+    {
+        QMutexLocker locker(&storagesmutex);
+        for(auto &weak : storages)
+        {
+            auto storage=weak.lock();
+            if(storage && storage.get()!=own && storage->readylanes.tryPop(lane))
+            {
+                storage->takeFrom(*lane,event);
+                storage->stolen++;
+                from=std::move(storage);
+                return true;
+            }
+        }
+        return false;
+    }
+    inline static quint64 nanosSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count();
+    }
+    inline static void addNanos(std::atomic<quint64> &total,std::atomic<quint64> &max,quint64 nanos)
+    {
+        total+=nanos;
+        quint64 current=max;
+        while(nanos > current && !max.compare_exchange_weak(current,nanos)) { }
+    }
+    void pickedUp(const discordmessage &event)
+    {
+        pickups++;
+        addNanos(pickupnanos,maxpickupnanos,nanosSince(event.received));
+    }
+    void handledEvent(const discordmessage &event,std::chrono::steady_clock::time_point started)
+    {
+        handled++;
+        addNanos(handlernanos,maxhandlernanos,nanosSince(started));
+        addNanos(endtoendnanos,maxendtoendnanos,nanosSince(event.received));
+    }
+    QString report()
+    {
+        quint64 n=pickups,h=handled;
+        QString r=QString("queued events: %1/%2 overflowed: %3 picked up: %4 avg pickup latency: %5us max: %6us stolen by other bots: %7 deferred behind higher priorities: %8")
+                .arg(queued).arg(queueCapacity).arg(overflowed).arg(n)
+                .arg(n ? pickupnanos/n/1000 : 0).arg(maxpickupnanos/1000).arg(stolen).arg(readylanes.deferred);
+        r+=QString(" duplicates: %1").arg(duplicates);
+        r+=QString("\n  handled: %1 avg handler time: %2us max: %3us avg end to end: %4us max: %5us")
+                .arg(h).arg(h ? handlernanos/h/1000 : 0).arg(maxhandlernanos/1000).arg(h ? endtoendnanos/h/1000 : 0).arg(maxendtoendnanos/1000);
+        for(int p=0; p < discordmessage::priorities; p++)
+        {
+            r+=QString("\n  %1 queued: %2 high-water: %3 archived only: %4 dropped: %5").arg(discordmessage::priorityName(p))
+                    .arg(queuedclass[p]).arg(highwater[p]).arg(degraded[p]).arg(dropped[p]);
+        }
+        return r+"\n"+lanes.report();
+    }
+    //False when the same payload hash was already seen within dedupeWindow, expired hashes fall out in arrival order
+    bool remember(quint64 hash)
+    {
+        QMutexLocker locker(&recentmutex);
+        qint64 now=QDateTime::currentMSecsSinceEpoch();
+        while(!recentorder.empty() && (recentorder.front().first+dedupeWindow <= now || recentorder.size() > queueCapacity))
+        {
+            auto it=recent.find(recentorder.front().second);
+            if(it!=recent.end() && it.value()==recentorder.front().first)
+                recent.erase(it);
+            recentorder.pop_front();
+        }
+        auto it=recent.find(hash);
+        if(it!=recent.end())
+            return false;
+        recent.insert(hash,now);
+        recentorder.emplace_back(now,hash);
+        return true;
+    }
+    //Queues an event on its lane unless the exact same dispatch went through recently, a repeat is only archived.
+    //Other ops (heartbeat acks, hellos, ...) are byte-identical from one to the next and always go through
+    bool enqueue(discordevent message)
+    {
+        if(message->id==0 && !remember(message->msg_hash))
+        {
+            if(duplicates++ % 1000==0)
+                qDebug() << "Duplicate dispatch archived without processing, so far:" << duplicates;
+            complete(std::move(message));
+            return false;
+        }
+        int p=message->priorityclass;
+        if(queuedclass[p] >= highwater[p])
+        {
+            if(p==discordmessage::BULK && dropbulk)
+            {
+                if(dropped[p]++ % 1000==0)
+                    qDebug() << "Bulk events over their high-water mark of" << highwater[p] << "dropped so far:" << dropped[p];
+                return false;
+            }
+            if(degraded[p]++ % 1000==0)
+                qDebug() << discordmessage::priorityName(p) << "events over their high-water mark of" << highwater[p] << "archived without processing so far:" << degraded[p];
+            complete(std::move(message));
+            return false;
+        }
+        if(queued.fetch_add(1) >= queueCapacity)
+        {
+            queued--;
+            dropped[p]++;
+            if(overflowed++ % 1000==0)
+                qDebug() << "Message queue full at" << queueCapacity << "events, dropped so far:" << overflowed;
+            return false;
+        }
+        queuedclass[p]++;
+        sptr<eventlane> lane;
+        if(lanes.push(std::move(message),lane))
+            readylanes.tryPush(p,std::move(lane)); //Can't be full, every lane in there holds at least one of the queued events
+        return true;
+    }
+    void takeFrom(eventlane &lane,discordevent &event)
+    {
+        QMutexLocker locker(&lane.mutex);
+        event=std::move(lane.pending.front());
+        lane.pending.pop_front();
+        queuedclass[lane.priority]--;
+        queued--;
+    }
+    //Claims the next ready lane and takes its oldest event, waiting like mpmcqueue::pop when none is ready.
+    //The lane stays claimed, so nothing else from it runs, until release()
+    template<class Cancelled> bool next(sptr<eventlane> &lane,discordevent &event,unsigned long timeout,Cancelled cancelled)
+    {
+        if(!readylanes.pop(lane,timeout,cancelled))
+            return false;
+        takeFrom(*lane,event);
+        return true;
+    }
+    bool tryNext(sptr<eventlane> &lane,discordevent &event)
+    {
+        if(!readylanes.tryPop(lane))
+            return false;
+        takeFrom(*lane,event);
+        return true;
+    }
+    //Done with the lane's event, it goes to the back of the ready queue if more arrived meanwhile
+    void release(sptr<eventlane> lane)
+    {
+        lane->processed++;
+        {
+            QMutexLocker locker(&lane->mutex);
+            if(lane->pending.empty())
+            {
+                lane->claimed=false;
+                return;
+            }
+        }
+        int p=lane->priority;
+        readylanes.tryPush(p,std::move(lane));
+    }
+    void complete(discordevent message)
+    {
+        QMutexLocker locker(&completedmutex);
+        messagescompleted.push_back(std::move(message));
+    }
     void determineOutputDirectoryAndFile()
     {
         QDateTime current=QDateTime::currentDateTime();
@@ -861,7 +1562,7 @@ public:
         json jsonFile=j::fromQString(bot::fileRead(currentOutputPath));
         for(auto &message : messagescompleted)
         {
-            QString wrapped=QString(R"({"t":"%1","m":%2})").arg(message.createdAt.toString()).arg(j::toQString(message.jsonmsg));
+            QString wrapped=QString(R"({"t":"%1","m":%2})").arg(message->createdAt.toString()).arg(j::toQString(message->jsonmsg));
             qDebug() << "Wrapped:" << wrapped;
             jsonFile.push_back(j::fromQString(wrapped));
         }
@@ -869,6 +1570,81 @@ public:
     }
 };
 
+//Discord lets max_concurrency shards of a bot identify at once, shards sharing shard_id % max_concurrency have to
+//wait identifyinterval between identifies, shared by every shard of the same token
+class identifyscheduler
+{
+private:
+    inline static QMutex registrymutex;
+    inline static QHash<QString,sptr<identifyscheduler>> registry;
+    QMutex mutex;
+    QHash<quint32,qint64> nextidentify; //Rate limit key -> earliest next identify
+public:
+    inline static qint64 identifyinterval=5000;
+    std::atomic<quint32> maxconcurrency=1;
+    inline static sptr<identifyscheduler> forBot(QString token)
+    {
+        QMutexLocker locker(&registrymutex);
+        auto &scheduler=registry[token];
+        if(!scheduler)
+            scheduler=std::make_shared<identifyscheduler>();
+        return scheduler;
+    }
+    //Books the shard's next identify slot and returns how many milliseconds to wait before sending it
+    qint64 reserve(quint32 shard)
+    {
+        QMutexLocker locker(&mutex);
+        qint64 now=QDateTime::currentMSecsSinceEpoch();
+        qint64 &next=nextidentify[shard%qMax(1u,quint32(maxconcurrency))];
+        qint64 at=qMax(now,next);
+        next=at+identifyinterval;
+        return at-now;
+    }
+};
+
+//Rolling window of the last windowSize samples, bucketed on a doubling scale for the report
+class latencyhistogram
+{
+private:
+    QMutex mutex;
+    std::deque<qint64> window; //Microseconds, oldest first
+    quint64 total=0;
+public:
+    inline static size_t windowSize=100;
+    inline static const vec<qint64> bounds={25,50,100,200,400,800,1600}; //Bucket upper bounds in ms
+    void add(qint64 micros)
+    {
+        QMutexLocker locker(&mutex);
+        window.push_back(micros);
+        if(window.size() > windowSize)
+            window.pop_front();
+        total++;
+    }
+    QString report()
+    {
+        QMutexLocker locker(&mutex);
+        if(window.empty())
+            return "no samples";
+        vec<qint64> sorted(window.begin(),window.end());
+        std::sort(sorted.begin(),sorted.end());
+        qint64 sum=0;
+        for(auto sample : sorted)
+            sum+=sample;
+        auto ms=[](qint64 micros){ return QString::number(micros/1000.0,'f',1); };
+        QString r=QString("samples: %1 (last %2) last: %3ms min: %4ms avg: %5ms p50: %6ms p95: %7ms max: %8ms")
+                .arg(total).arg(sorted.size()).arg(ms(window.back())).arg(ms(sorted.front())).arg(ms(sum/(qint64)sorted.size()))
+                .arg(ms(sorted[sorted.size()/2])).arg(ms(sorted[sorted.size()*95/100])).arg(ms(sorted.back()));
+        size_t i=0;
+        for(auto bound : bounds)
+        {
+            size_t n=0;
+            for(; i < sorted.size() && sorted[i] < bound*1000; i++) n++;
+            r+=QString(" <%1ms: %2").arg(bound).arg(n);
+        }
+        return r+QString(" more: %1").arg(sorted.size()-i);
+    }
+};
+
 class WebSocketService : public Thread<WebSocketWorker>
 {
     Q_OBJECT
@@ -876,27 +1652,44 @@ signals:
     void openConnection(QString url);
     qint64 sendTextMessage(const QString &message);
     void closeConnection();
+    void reconnect(QString url);
     void textMessageReceived(QString message);
 private:
     ptr<QTimer> autoConnect,autoHeartbeat,autoLogMessages;
     QString websocketurl,botkey,session_id,botDirectory;
-    QMutex mutex;
-    std::atomic<quint64> checkConnectionDelay=3*1000,timeoutUntil=0,heartbeat_interval=41250,sequence=0,invalid_session_count=0;
+    QString resumeurl; //resume_gateway_url from READY, resumes connect there instead
+    QMutex urlmutex; //websocketurl and resumeurl, the worker thread reads them when it reconnects
+    std::atomic<quint64> checkConnectionDelay=3*1000,timeoutUntil=0,heartbeat_interval=41250,invalid_session_count=0;
+    sptr<identifyscheduler> identifies;
 public:
-    ptr<messagestorage> messages;
+    sptr<messagestorage> messages; //Shared by all shards of a bot, shard 0 writes it to disk
+    const quint32 shard,shardcount;
+    std::atomic<quint32> intents=0; //0 leaves them out of identify
     std::atomic<bool> resumable=false,heartbeat_ack=false,messagesWritten=false,probablyBadKey=false;
-    explicit WebSocketService(QObject *parent=nullptr,QString botKey="") : Thread<WebSocketWorker>(new WebSocketWorker,parent),botkey(botKey)
-    {
+    std::atomic<bool> replaying=false; //Fed from a capture instead of a connection
+    std::atomic<qint64> heartbeatsent=0; //steady clock microseconds of the heartbeat waiting for its ack, 0 when none
+    std::atomic<quint64> heartbeats=0,missedacks=0,connections=0;
+    latencyhistogram heartbeatrtt;
+    inline static qint64 resumeWindow=5*60*1000; //How old a saved session can be and still be worth a resume attempt on startup
+    explicit WebSocketService(QObject *parent=nullptr,QString botKey="",sptr<messagestorage> storage=nullptr,quint32 shardId=0,quint32 shardCount=1,sptr<gatewayfilter> filter=nullptr)
+        : Thread<WebSocketWorker>(new WebSocketWorker,parent),botkey(botKey),identifies(identifyscheduler::forBot(botKey)),
+          messages(storage),shard(shardId),shardcount(qMax(1u,shardCount))
+    {
+        worker->filter=filter;
+        worker->shard=(quint16)shard;
         //Signals to slots
         connect(this,&WebSocketService::started,this,&WebSocketService::startTimers);
         connect(this,&WebSocketService::openConnection,worker,&WebSocketWorker::onOpenConnection);
         connect(this,&WebSocketService::sendTextMessage,worker,&WebSocketWorker::onSendTextMessage);
         connect(this,&WebSocketService::closeConnection,worker,&WebSocketWorker::onCloseConnection);
+        connect(this,&WebSocketService::reconnect,worker,&WebSocketWorker::onReconnect);
         connect(worker,&WebSocketWorker::textMessageReceived,this,&WebSocketService::onTextMessageReceived);
+        connect(worker,&WebSocketWorker::eventReceived,this,&WebSocketService::onEventReceived);
         //Signal forwarding
         connect(worker,&WebSocketWorker::textMessageReceived,this,&WebSocketService::textMessageReceived);
 
-        messages=make<messagestorage>();
+        if(!messages)
+            messages=std::make_shared<messagestorage>();
         autoConnect=make<QTimer>();
         autoHeartbeat=make<QTimer>();
         autoLogMessages=make<QTimer>();
@@ -909,24 +1702,18 @@ public:
                 timeoutUntil=current_time+timeout_time*1000;
                 qDebug() << "Connecting failed after" << ((worker->connectionfailures+1)*3) << "attempts, timing out for" << timeout_time << "seconds... on:" << this;
             }
-            if(!worker->connected && bot::isNotEmptyOrNull(websocketurl) && !probablyBadKey)
+            QString url=connectUrl();
+            if(!worker->connected && bot::isNotEmptyOrNull(url) && !probablyBadKey)
             {
                 if(timeoutUntil > current_time)
                     qDebug() << "Still in timeout for" << ((timeoutUntil-current_time) / 1000) << "seconds... on:" << this;
                 else
-                    openConnection(websocketurl);
+                    openConnection(url);
             }
         });
         connect(autoHeartbeat.get(),&QTimer::timeout,worker,[&]
         {
-            if(worker->connected)
-            {
-                QString heartbeat=QString(R"({"op":1,"d":%1})").arg(sequence);
-                //Send heartbeat
-                qDebug() << "Sending heartbeat:" << heartbeat << "from:" << this;
-                heartbeat_ack=false;
-                sendTextMessage(heartbeat);
-            }
+            heartbeat();
         });
         connect(autoLogMessages.get(),&QTimer::timeout,this,&WebSocketService::writeCompletedMessagesToDisk);
         startService();
@@ -937,33 +1724,145 @@ public:
         qDebug() << this << "destructed!";
     }
     void setBotPath(QString path) { messages->botDirectory=botDirectory=path; }
-    void setUrl(QString url) { websocketurl=url; }
+    inline static qint64 steadyMicros() { return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+    //The previous heartbeat still not acked means the connection is a zombie, reconnect and resume right away
+    //instead of waiting minutes for tcp to notice
+    void heartbeat()
+    {
+        if(!worker->connected)
+            return;
+        if(!heartbeat_ack)
+        {
+            missedacks++;
+            qDebug() << "Heartbeat not acknowledged within" << heartbeat_interval << "ms, reconnecting to resume... on:" << this;
+            heartbeat_ack=true;
+            heartbeatsent=0;
+            reconnect(connectUrl());
+            return;
+        }
+        QString heartbeat=QString(R"({"op":1,"d":%1})").arg(worker->sequence);
+        //Send heartbeat
+        qDebug() << "Sending heartbeat:" << heartbeat << "from:" << this;
+        heartbeat_ack=false;
+        heartbeats++;
+        heartbeatsent=steadyMicros();
+        sendTextMessage(heartbeat);
+    }
+    QString report()
+    {
+        return QString("%1 heartbeats: %2 missed acks: %3 heartbeat rtt %4").arg(worker->report()).arg(heartbeats).arg(missedacks).arg(heartbeatrtt.report());
+    }
+    void setUrl(QString url)
+    {
+        QMutexLocker locker(&urlmutex);
+        websocketurl=url;
+    }
+    //Where the next connection goes: the resume url with the gateway's version/encoding query while there's a session to resume
+    QString connectUrl()
+    {
+        QMutexLocker locker(&urlmutex);
+        if(!resumable || bot::isEmptyOrNull(resumeurl) || bot::isEmptyOrNull(websocketurl))
+            return websocketurl;
+        QUrl url(resumeurl),gateway(websocketurl);
+        url.setPath(gateway.path().isEmpty() ? "/" : gateway.path());
+        url.setQuery(gateway.query());
+        return url.toString();
+    }
+    //Checkpoints the session next to bot_config.json, a restart within resumeWindow resumes instead of identifying
+    void saveSession()
+    {
+        if(bot::isEmptyOrNull(botDirectory) || bot::isEmptyOrNull(session_id)) return;
+        QString url;
+        {
+            QMutexLocker locker(&urlmutex);
+            url=resumeurl;
+        }
+        json session={{"session_id",session_id.toStdString()},{"sequence",worker->sequence.load()},
+                      {"resume_gateway_url",url.toStdString()},{"saved_at",QDateTime::currentMSecsSinceEpoch()}};
+        bot::fileWrite(j::toQString(session).toUtf8(),botpaths(botDirectory).sessionPath(shard));
+    }
+    void clearSession()
+    {
+        session_id.clear();
+        {
+            QMutexLocker locker(&urlmutex);
+            resumeurl.clear();
+        }
+        if(bot::isNotEmptyOrNull(botDirectory))
+            QFile::remove(botpaths(botDirectory).sessionPath(shard));
+    }
+    void loadSession()
+    {
+        bool successful=false;
+        QByteArray saved=bot::fileRead(botpaths(botDirectory).sessionPath(shard),&successful);
+        if(!successful) return;
+        json session=j::fromQString(saved);
+        QString id=j::unquote(j::at(session,{"session_id"}));
+        qint64 age=QDateTime::currentMSecsSinceEpoch()-j::to<qint64>(j::at(session,{"saved_at"}));
+        if(bot::isEmptyOrNull(id) || age > resumeWindow)
+        {
+            qDebug() << "Saved session for shard" << shard << "is" << age/1000 << "seconds old, identifying instead";
+            return;
+        }
+        session_id=id;
+        worker->sequence=j::to<quint64>(j::at(session,{"sequence"}));
+        {
+            QMutexLocker locker(&urlmutex);
+            resumeurl=j::unquote(j::at(session,{"resume_gateway_url"}));
+        }
+        resumable=true;
+        qDebug() << "Resuming saved session" << session_id << "at sequence" << worker->sequence << "for shard" << shard;
+    }
     void suspendService() { if(!worker->suspended) worker->suspend(); }
     void resumeService() { if(worker->suspended) worker->resume(); }
     void startTimers()
     {
         autoConnect->start(checkConnectionDelay);
-        autoLogMessages->start(messagestorage::nextLogMessagesDelay);
+        if(shard==0)
+            autoLogMessages->start(messagestorage::nextLogMessagesDelay);
     }
     void startService(QString url="")
     {
         if(bot::isNotEmptyOrNull(url)) setUrl(url);
-        openConnection(websocketurl);
+        openConnection(connectUrl());
     }
     void stopService()
     {
+        saveSession();
+        heartbeatsent=0;
         autoConnect->stop();
         autoHeartbeat->stop();
         autoLogMessages->stop();
         closeConnection();
     }
-    void onTextMessageReceived(QString textMessage)
+    void onTextMessageReceived(QString textMessage,bool archiveonly=false)
     {
-        json msg=j::fromQString(textMessage);
-        if(msg["s"] != nullptr)
+        if(archiveonly)
+        {
+            onEvent(j::fromQString(textMessage),fasthash::of(textMessage),archiveonly);
+            return;
+        }
+        auto roster=std::make_shared<guildroster>();
+        bool streamed=false;
+        json event=gatewayparser::parse(textMessage,*roster,&streamed);
+        onEvent(std::move(event),fasthash::of(textMessage),archiveonly,streamed ? roster : nullptr);
+    }
+    void onEventReceived(json event,bool archiveonly=false,quint64 payloadhash=0)
+    {
+        onEvent(std::move(event),payloadhash,archiveonly);
+    }
+    //Every gateway payload the worker's prefilter lets through ends up here parsed exactly once, whether it came in as json text or etf
+    void onEvent(json msg,quint64 payloadhash,bool archiveonly,sptr<const guildroster> roster=nullptr)
+    {
+        if(archiveonly) //No handler wants it, straight to the message log
+        {
+            messages->complete(discordmessage::archiveOnly(std::move(msg),shard));
+            return;
+        }
+        if(replaying) //Nothing is answered and the saved session is left alone, the events are just processed
         {
-            sequence=j::to<quint32>(msg["s"]);
-            qDebug() << "Last received sequence:" << sequence;
+            acceptmessage(std::make_shared<const discordmessage>(std::move(msg),payloadhash,shard,false,std::move(roster)));
+            return;
         }
         quint32 op=j::to<quint32>(msg["op"]);
         QString t=j::unquote(msg["t"]);
@@ -971,6 +1870,8 @@ public:
         {
             probablyBadKey=(++invalid_session_count > 1 && bot::isEmptyOrNull(session_id));
             resumable=j::to<bool>(msg["d"]);
+            if(!resumable)
+                clearSession(); //The next hello identifies on the main gateway url
             if(probablyBadKey)
             {
                 stopService();
@@ -987,54 +1888,77 @@ public:
         else if(op==10) //Hello
         {
             heartbeat_interval=j::to<quint32>(msg["d"]["heartbeat_interval"]);
-            qDebug() << "Received heartbeat interval:" << heartbeat_interval << "for:" << this;
-            autoHeartbeat->start(heartbeat_interval-1000);
+            //First heartbeat after a random fraction of the interval as the gateway asks, so reconnecting shards don't beat in lockstep
+            qint64 jitter=QRandomGenerator::global()->bounded((int)heartbeat_interval);
+            qDebug() << "Received heartbeat interval:" << heartbeat_interval << "first heartbeat in:" << jitter << "ms for:" << this;
+            heartbeat_ack=true;
+            heartbeatsent=0;
+            autoHeartbeat->stop();
+            quint64 connection=++connections;
+            QTimer::singleShot(jitter,this,[this,connection]
+            {
+                if(connection!=connections || !worker->connected) return; //Another hello came in meanwhile or the connection is gone
+                heartbeat();
+                autoHeartbeat->start(heartbeat_interval-1000);
+            });
             if(resumable)
             {
-                QString resume=QString(R"({"op":6,"d":{"token":"%1","session_id":"%2","seq":%3}})").arg(botkey).arg(session_id).arg(sequence);
+                QString resume=QString(R"({"op":6,"d":{"token":"%1","session_id":"%2","seq":%3}})").arg(botkey).arg(session_id).arg(worker->sequence);
                 //Send resume!
                 sendTextMessage(resume);
                 qDebug() << "Sent resume! : " << j::unescape(resume);
             }
             else
             {
-                QString hello=QString(R"({"op":2,"d":{"token":"%1","properties":{"$os":"linux","$browser":"firefox","$device":"laptop"}}})").arg(botkey);
+                QString shardinfo=(shardcount > 1 ? QString(R"("shard":[%1,%2],)").arg(shard).arg(shardcount) : QString());
+                if(intents) shardinfo+=QString(R"("intents":%1,)").arg(intents);
+                QString hello=QString(R"({"op":2,"d":{"token":"%1",%2"properties":{"$os":"linux","$browser":"firefox","$device":"laptop"}}})").arg(botkey).arg(shardinfo);
                 resumable=true;
-                //Send identify!
-                sendTextMessage(hello);
-                qDebug() << "Sent identify! : " << j::unescape(hello);
+                //Send identify! once this shard's max_concurrency slot comes up
+                qint64 delay=identifies->reserve(shard);
+                QTimer::singleShot(delay,this,[this,hello,delay]
+                {
+                    if(!worker->connected) return;
+                    sendTextMessage(hello);
+                    qDebug() << "Sent identify! after waiting" << delay << "ms for shard" << shard << ":" << j::unescape(hello);
+                });
             }
         }
         else if(op==11) //Heartbeart acknowledged
         {
+            qint64 sent=heartbeatsent.exchange(0);
+            if(sent > 0)
+                heartbeatrtt.add(steadyMicros()-sent);
             heartbeat_ack=true;
-            qDebug() << "Heartbeat acknowledged! :" << j::unescape(textMessage);
+            saveSession(); //Keeps the checkpointed sequence about one heartbeat behind
+            qDebug() << "Heartbeat acknowledged! :" << j::unescape(j::toQString(msg));
         }
         else if(op==0 && t=="RESUMED")
         {
-            qDebug() << "Resumed connection! :" << j::unescape(textMessage);
+            qDebug() << "Resumed connection! :" << j::unescape(j::toQString(msg));
+            saveSession();
         }
         else if(op==0 && t=="READY")
         {
             session_id=j::unquote(msg["d"]["session_id"]);
+            {
+                QMutexLocker locker(&urlmutex);
+                resumeurl=j::unquote(msg["d"]["resume_gateway_url"]);
+            }
+            saveSession();
         }
-        acceptmessage(discordmessage(textMessage));
+        acceptmessage(std::make_shared<const discordmessage>(std::move(msg),payloadhash,shard,false,std::move(roster)));
     }
-    void acceptmessage(discordmessage msg)
+    void acceptmessage(discordevent msg)
     {
-        for(auto &m : messages->messagequeue)
-        {
-            if(m.msg_hash==msg.msg_hash) //Dont insert the exact same message more than once
-                return;
-        }
-        messages->messagequeue.push_back(msg);
+        messages->enqueue(std::move(msg));
     }
     void writeCompletedMessagesToDisk()
     {
         messagesWritten=false;
         auto writeMessagesThread=QThread::create([&]
         {
-            QMutexLocker locker(&mutex);
+            QMutexLocker locker(&messages->completedmutex);
             if((messages->messagescompleted.size() > messagestorage::writeMessagesThreshold || SuspendableThread::shouldAllStop())
                     && messages->writeMessagesToDisk())
             {
@@ -1231,6 +2155,113 @@ public:
     inline static void setPath(QString path) { auto stack=get(); stack->stackoverflowJsonPath=path+"/stack.json"; stack->deserialize(); stack->release(); }
 };
 
+class outboundpost
+{
+public:
+    httpsrequest request;
+    QString content;
+    bool coalescable=false;
+};
+
+class outboundchannel
+{
+public:
+    std::deque<outboundpost> queue;
+    bool inflight=false;
+};
+
+//Per channel outbound queue, posts to one channel go out in order one at a time while channels run in parallel
+//Small plain text posts that pile up behind an in flight one get merged into a single post when they fit
+class discordoutbox : public std::enable_shared_from_this<discordoutbox>
+{
+private:
+    QMutex mutex;
+    QHash<QString,outboundchannel> channels;
+    sptr<discordratelimiter> ratelimiter;
+    std::function<httpsrequest(const QString &channelId,const QString &content)> textrequest;
+    int maxchars=2000;
+public:
+    std::atomic<quint64> posts=0,requests=0,coalesced=0;
+    discordoutbox(sptr<discordratelimiter> limiter,std::function<httpsrequest(const QString&,const QString&)> textRequest,int maxCharsPerPost=2000)
+        : ratelimiter(limiter),textrequest(textRequest),maxchars(maxCharsPerPost) { }
+    void postText(const QString &channelId,const QString &content,bool coalescable=true)
+    {
+        outboundpost post;
+        post.content=content;
+        post.coalescable=coalescable;
+        post.request=textrequest(channelId,content);
+        postRequest(channelId,post);
+    }
+    void postRequest(const QString &channelId,outboundpost post)
+    {
+        QMutexLocker locker(&mutex);
+        posts++;
+        auto &channel=channels[channelId];
+        channel.queue.push_back(post);
+        if(!channel.inflight)
+            next(channelId);
+    }
+    int queueDepth()
+    {
+        QMutexLocker locker(&mutex);
+        int depth=0;
+        for(auto &channel : channels)
+            depth+=channel.queue.size();
+        return depth;
+    }
+    QString report()
+    {
+        return QString("discordoutbox posts: %1 requests: %2 coalesced: %3 queued: %4").arg(posts).arg(requests).arg(coalesced).arg(queueDepth());
+    }
+private:
+    //Must hold mutex
+    void next(const QString &channelId)
+    {
+        auto it=channels.find(channelId);
+        if(it==channels.end()) return;
+        if(it->queue.empty())
+        {
+            channels.erase(it);
+            return;
+        }
+        outboundpost post=it->queue.front();
+        it->queue.pop_front();
+        if(post.coalescable)
+        {
+            int length=j::unescape(post.content).size();
+            int merged=0;
+            while(!it->queue.empty() && it->queue.front().coalescable)
+            {
+                int nextlength=j::unescape(it->queue.front().content).size();
+                if(length+1+nextlength > maxchars) break;
+                post.content+="\\n"+it->queue.front().content;
+                length+=1+nextlength;
+                it->queue.pop_front();
+                merged++;
+            }
+            if(merged > 0)
+            {
+                post.request=textrequest(channelId,post.content);
+                coalesced+=merged;
+            }
+        }
+        it->inflight=true;
+        requests++;
+        std::weak_ptr<discordoutbox> self=shared_from_this();
+        QString channel=channelId;
+        ratelimiter->submit(post.request,[self,channel](httpsresponse)
+        {
+            auto outbox=self.lock();
+            if(!outbox) return;
+            QMutexLocker locker(&outbox->mutex);
+            auto it=outbox->channels.find(channel);
+            if(it==outbox->channels.end()) return;
+            it->inflight=false;
+            outbox->next(channel);
+        });
+    }
+};
+
 class discordbot : public QObject
 {
     Q_OBJECT
@@ -1238,27 +2269,65 @@ signals:
     void setBotPath(QString path);
     void writeCompletedMessagesToDisk();
 private:
-    ptr<WebSocketService> websocket;
-    v2p<SuspendableThread> processingthreads;
+    v2p<WebSocketService> shards;
+    sptr<messagestorage> messages;
+    sptr<gatewayfilter> filter;
+    sptr<discordratelimiter> ratelimiter;
+    sptr<discordoutbox> outbox;
+    ptr<WorkerPool> processing;
+    ptr<QTimer> autoSnapshot; //Saves the user cache when it changed
+    sptr<gatewayrecorder> recorder; //Every shard's raw gateway traffic when recording
+    ptr<QThread> replayer; //Feeds a capture to the shards instead of connecting them
+    std::atomic<bool> stopreplay=false;
     discordusers discordUsers;
-    QString botname,botkey,auth,host,api_url,get_gateway_url,websocket_url,websocket_url_action,post_message_url,is_typing_url,bot_path,userAgent,session_id,user_id,disc,avatar_url,avatar;
-    QString updateStreamingStatusesOnChannel;
-    QMutex mutex;
+    QString botname,botkey,auth,base_url,api_url,get_gateway_url,websocket_url,websocket_url_action,post_message_url,is_typing_url,bot_path,userAgent,session_id,user_id,disc,avatar_url,avatar;
+    QString updateStreamingStatusesOnChannel,gatewayencoding="json"; //"etf" for the binary erlang term format
     quint64 version=7,resultLimit=5,msgLimit=1;
+    quint32 shardcount=1,intents=0; //Intents 0 derives them from the registered handlers
+    bool archiveunhandled=true; //Events no handler wants still go to the message log, or are dropped when false
+    bool autoshard=false; //Take the shard count discord recommends from /gateway/bot
     int maxcharsperpost=2000,maxposts=7;
-    bool tts=false;
+    bool tts=false,gatewaycompression=true;
+    bool workstealing=false;
+    QString recordpath,replaypath;
+    double replayspeed=1; //0 replays as fast as the processing threads take it
 public:
-    discordbot(QString key) : botkey(key) { websocket=make<WebSocketService>(this,key); }
-    ~discordbot() { SuspendableThread::setAllShouldStop(); writeCompletedMessagesToDisk(); Waiter w(2000); while(!websocket->messagesWritten && w.timeNotElapsed()) { } }
+    discordbot(QString key) : botkey(key)
+    {
+        messages=std::make_shared<messagestorage>();
+        messagestorage::addStorage(messages);
+    }
+    ~discordbot()
+    {
+        if(replayer)
+        {
+            stopreplay=true;
+            replayer->wait();
+        }
+        if(recorder)
+        {
+            activitylogger::dbg(QString("%1 recorded %2 gateway payloads, %3 bytes").arg(botname).arg(recorder->frames).arg(recorder->bytes));
+            recorder->close();
+        }
+        if(outbox) activitylogger::dbg(outbox->report());
+        for(auto &shard : shards)
+            activitylogger::dbg(QString("%1 shard %2/%3 %4").arg(botname).arg(shard->shard).arg(shard->shardcount).arg(shard->report()));
+        if(filter) activitylogger::dbg(QString("%1 %2").arg(botname).arg(filter->report()));
+        if(processing) processing->stop();
+        activitylogger::dbg(QString("%1 %2").arg(botname).arg(messages->report()));
+        if(autoSnapshot) autoSnapshot->stop();
+        if(discordUsers.changed) discordUsers.save();
+        SuspendableThread::setAllShouldStop();
+        writeCompletedMessagesToDisk();
+        Waiter w(2000);
+        while(!shards.empty() && !shards.front()->messagesWritten && w.timeNotElapsed()) { }
+    }
     void run()
     {
-        connect(this,&discordbot::setBotPath,websocket.get(),&WebSocketService::setBotPath);
-        connect(this,&discordbot::writeCompletedMessagesToDisk,websocket.get(),&WebSocketService::writeCompletedMessagesToDisk);
         auth="Bot "+botkey;
-        host="discordapp.com";
-        get_gateway_url="/api/gateway";
+        base_url="https://discordapp.com";
+        get_gateway_url="/api/gateway/bot";
         websocket_url="wss://gateway.discord.gg";
-        websocket_url_action=QString("/?v=%1&encoding=json").arg(version);
         api_url=QString("/api/v%1").arg(version);
         post_message_url=api_url+"/channels/%1/messages";
         is_typing_url=api_url+"/channels/%1/typing";
@@ -1269,17 +2338,105 @@ public:
             qDebug() << "Commands are setup!";
         }
         initProcessingThreads();
-        websocket->startService(websocket_url+websocket_url_action);
+        websocket_url_action=QString("/?v=%1&encoding=%2%3").arg(version).arg(gatewayencoding).arg(gatewaycompression ? "&compress=zlib-stream" : "");
+        ratelimiter=discordratelimiter::forBot(auth,userAgent);
+        ratelimiter->dryrun=!replaypath.isEmpty(); //A replay must not post anything for real
+        outbox=std::make_shared<discordoutbox>(ratelimiter,[base=base_url,url=post_message_url,tts=tts](const QString &channelId,const QString &content)
+        {
+            return httpsrequest::post(base+url.arg(channelId),QString(R"({"content":"%1","tts":%2})").arg(content).arg(tts));
+        },maxcharsperpost);
+        if(autoshard && replaypath.isEmpty())
+            getGateway();
+        startShards();
+    }
+    //One websocket service and worker thread per shard, all feeding the same message storage and processing threads
+    void startShards()
+    {
+        filter=std::make_shared<gatewayfilter>();
+        filter->wanted=commands::handledEvents();
+        filter->archiveunwanted=archiveunhandled;
+        quint32 identifyintents=(intents ? intents : gatewayintents::forEvents(filter->wanted));
+        qDebug() << botname << "handles:" << filter->wanted.values() << "intents:" << identifyintents;
+        auto capture=std::make_shared<gatewayreader>();
+        if(!replaypath.isEmpty())
+        {
+            if(!capture->open(replaypath))
+            {
+                qDebug() << botname << "could not replay:" << replaypath;
+                return;
+            }
+            shardcount=capture->shardcount;
+        }
+        else if(!recordpath.isEmpty())
+        {
+            recorder=std::make_shared<gatewayrecorder>();
+            if(!recorder->open(recordpath,(quint16)shardcount))
+                recorder.reset();
+        }
+        for(quint32 i=0; i < shardcount; i++)
+        {
+            auto shard=make<WebSocketService>(this,botkey,messages,i,shardcount,filter);
+            shard->intents=identifyintents;
+            shard->setBotPath(bot_path);
+            connect(this,&discordbot::setBotPath,shard.get(),&WebSocketService::setBotPath);
+            if(i==0)
+                connect(this,&discordbot::writeCompletedMessagesToDisk,shard.get(),&WebSocketService::writeCompletedMessagesToDisk);
+            if(!replaypath.isEmpty())
+                shard->replaying=true;
+            else
+            {
+                shard->worker->recorder=recorder;
+                shard->loadSession();
+                shard->startService(websocket_url+websocket_url_action);
+            }
+            shards.push_back(std::move(shard));
+        }
+        qDebug() << botname << "started" << shardcount << "gateway shard(s)";
+        if(!replaypath.isEmpty())
+            startReplay(capture);
+        autoSnapshot=make<QTimer>();
+        connect(autoSnapshot.get(),&QTimer::timeout,this,[this]
+        {
+            if(discordUsers.changed) discordUsers.save();
+        });
+        autoSnapshot->start(messagestorage::nextLogMessagesDelay);
     }
-    void initProcessingThreads()
+    //Paces the captured payloads like they arrived (or as fast as possible) into the shard workers, through the same
+    //filtering and processing as live traffic, then logs the throughput and processing latencies
+    void startReplay(sptr<gatewayreader> capture)
     {
-        for(qint64 i=0; i < bot_instances::thread_allowance; i++)
+        qDebug() << botname << "replaying" << replaypath << "at" << (replayspeed > 0 ? QString::number(replayspeed)+"x" : QString("max")) << "speed";
+        replayer.reset(QThread::create([this,capture]
         {
-            processingthreads.push_back(make<SuspendableThread>([&]
+            gatewaycapture::frame frame;
+            quint64 frames=0;
+            QElapsedTimer clock;
+            clock.start();
+            while(!stopreplay && capture->next(frame))
             {
-                processNextMessageAndExecuteCommand();
-            }));
-        }
+                if(replayspeed > 0)
+                {
+                    qint64 due=(qint64)(frame.micros/replayspeed),now=clock.nsecsElapsed()/1000;
+                    if(due > now)
+                        QThread::usleep((unsigned long)(due-now));
+                }
+                auto &shard=shards[frame.shard < shards.size() ? frame.shard : 0];
+                auto worker=shard->worker;
+                QMetaObject::invokeMethod(worker,[worker,frame]{ worker->onReplayFrame(frame); });
+                frames++;
+            }
+            for(auto &shard : shards) //Lets the workers route what's still in their event loops
+                QMetaObject::invokeMethod(shard->worker,[]{ },Qt::BlockingQueuedConnection);
+            while(!stopreplay && messages->queued > 0)
+                QThread::msleep(10);
+            qint64 elapsed=qMax<qint64>(1,clock.elapsed());
+            activitylogger::dbg(QString("%1 replayed %2 gateway payloads in %3 ms, %4 payloads/s\n  %5\n  %6")
+                                .arg(botname).arg(frames).arg(elapsed).arg(frames*1000/elapsed).arg(messages->report()).arg(ratelimiter->report()));
+        }));
+        replayer->start();
+    }
+    void initProcessingThreads()
+    {
         bot *b=bot_instances::get()->botByKey(botkey);
         if(b)
         {
@@ -1287,21 +2444,71 @@ public:
             userAgent=botname=b->botName;
             setBotPath(bot_path);
             discordUsers.botPaths=botpaths(bot_path);
+            if(discordUsers.load() && discordUsers.self!=nullptr)
+            {
+                user_id=j::unquote(j::at(discordUsers.self,{"id"}));
+                disc=j::unquote(j::at(discordUsers.self,{"discriminator"}));
+                avatar=j::unquote(j::at(discordUsers.self,{"avatar"}));
+            }
             stackoverflow::setPath(bot_path);
+            if(bot::isNotEmptyOrNull(b->apiBase))
+                base_url=b->apiBase;
+            if(bot::isNotEmptyOrNull(b->gatewayUrl))
+                websocket_url=b->gatewayUrl;
+            if(b->shards=="auto")
+                autoshard=true;
+            else if(b->shards.toUInt() > 0)
+                shardcount=b->shards.toUInt();
+            if(b->intents.toUInt() > 0)
+                intents=b->intents.toUInt();
+            archiveunhandled=(b->unhandledEvents!="drop");
+            if(b->gatewayEncoding=="json" || b->gatewayEncoding=="etf")
+                gatewayencoding=b->gatewayEncoding;
+            if(bot::isNotEmptyOrNull(b->trustedCert) && !httpsclient::trustCertificates(b->trustedCert))
+                qDebug() << "Could not load trusted certificate:" << b->trustedCert;
+            workstealing=b->workStealing;
+            if(b->commandHighWater.toUInt() > 0)
+                messages->highwater[discordmessage::COMMAND]=b->commandHighWater.toUInt();
+            if(b->bulkHighWater.toUInt() > 0)
+                messages->highwater[discordmessage::BULK]=b->bulkHighWater.toUInt();
+            messages->dropbulk=(b->bulkOverflow=="drop");
+            if(b->record=="yes")
+                recordpath=b->botPaths.botPath+QDateTime::currentDateTime().toString("/'gateway_'yyyyMMdd_hhmmss'.cap'");
+            else if(bot::isNotEmptyOrNull(b->record) && b->record!="no")
+                recordpath=b->record;
+            if(bot::isNotEmptyOrNull(b->replay))
+                replaypath=b->replay;
+            if(b->replaySpeed=="max")
+                replayspeed=0;
+            else if(b->replaySpeed.toDouble() > 0)
+                replayspeed=b->replaySpeed.toDouble();
         }
         bot_instances::release();
+        processing=make<WorkerPool>(bot_instances::thread_allowance,[this](WorkerPool &pool)
+        {
+            processNextMessageAndExecuteCommand(pool);
+        },[this]
+        {
+            messages->readylanes.wakeAll();
+        });
     }
     void suspend()
     {
-        SuspendableThread::setAllSuspended();
-        websocket->suspend();
-        websocket->setUrl("");
+        if(processing) processing->suspend();
+        for(auto &shard : shards)
+        {
+            shard->suspend();
+            shard->setUrl("");
+        }
     }
     void resume()
     {
-        SuspendableThread::setAllResume();
-        websocket->resume();
-        websocket->setUrl(websocket_url+websocket_url_action);
+        if(processing) processing->resume();
+        for(auto &shard : shards)
+        {
+            shard->resume();
+            shard->setUrl(websocket_url+websocket_url_action);
+        }
     }
     void setWebClientConfigForDiscord(httpsclient &https)
     {
@@ -1309,43 +2516,24 @@ public:
         https.setAuthorization(auth);
         https.setUserAgent(userAgent);
     }
-    void processNextMessageAndExecuteCommand()
+    //Blocks until a lane has an event or the pool is suspended/stopped, with work stealing an idle thread
+    //first helps out other bots before going to sleep. Other threads meanwhile work on other lanes
+    void processNextMessageAndExecuteCommand(WorkerPool &pool)
     {
-        QMutexLocker locker(&mutex);
-        auto &messages=websocket->messages;
-        if(messages->messagequeue.empty()) return;
-        discordmessage &message=messages->messagequeue.front();
-        for(auto &cmdarray : commands::get()->cmds)
-        {
-            for(auto &cmd : cmdarray.cmds)
-            {
-                if(cmd==message) //Message has a command to execute for it
-                {
-                    discordmessage messagecopy(message);
-                    //Move message to completed array once handled both discord and user commands from message
-                    if((message.hasUserCommand && message.handledUserCommand) || (!message.hasUserCommand && message.handledDiscordCommand))
-                    {
-                        messages->messagescompleted.push_back(messagecopy);
-                        messages->messagequeue.erase(messages->messagequeue.begin());
-                    }
-                    locker.unlock();
-
-                    //Execute command for message (a copy of it so other threads can continue processing messages while this command executes)
-                    cmd.func(messagecopy);
-
-                    if(messagecopy.handledDiscordCommand && !messagecopy.hasUserCommand)
-                        qDebug() << "Executed matched discord command with cmd_id_hash:" << messagecopy.cmd_id_hash.toHex();
-                    else if(messagecopy.handledUserCommand && messagecopy.hasUserCommand)
-                        qDebug() << "Executed matched user command with usercmd_id_hash:" << messagecopy.usercmd_id_hash.toHex();
-                    return;
-                }
-            }
-        }
-        //qDebug() << "Message not handled with cmd_id_hash:" << message.cmd_id_hash.toHex() << "nor usercmd_id_hash:" << message.usercmd_id_hash.toHex();
-        //No command to execute exists for this message, move it to completed array anyway
-        message.completed=3; //3 == Unhandled message, 2 == User command + Discord command completed, 1 == Discord command completed
-        messages->messagescompleted.push_back(message);
-        messages->messagequeue.erase(messages->messagequeue.begin());
+        discordevent event;
+        sptr<eventlane> lane;
+        sptr<messagestorage> from=messages;
+        if(!messages->tryNext(lane,event) && !(workstealing && messagestorage::steal(messages.get(),lane,event,from))
+                && !messages->next(lane,event,ULONG_MAX,[&pool]{ return pool.interrupted(); }))
+            return;
+        from->pickedUp(*event);
+        //Handlers run on the shared event while the other threads keep pulling from the queue
+        auto started=std::chrono::steady_clock::now();
+        commands::dispatch(*event);
+        from->handledEvent(*event,started);
+        from->release(std::move(lane));
+        //Handled or not it goes to the completed array for the message log
+        from->complete(event);
     }
     void setupCommands()
     {
@@ -1354,61 +2542,72 @@ public:
 
 //Vital features like sending out a heartbeat, maintaining connection on and reconnecting the websocket,
 //and handling invalid session and resuming, are now handled by the websocket service automatically.
-//        commands::onDiscord("null",11,[&](discordmessage &msg) //Heartbeat acknowledgement
+//        commands::onDiscord("null",11,[&](const discordmessage &msg) //Heartbeat acknowledgement
 //        {
 //            qDebug() << "Heartbeat acknowledged!";
 //        });
-//        commands::onDiscord("null",9,[&](discordmessage &msg) //Invalid session
+//        commands::onDiscord("null",9,[&](const discordmessage &msg) //Invalid session
 //        {
 //        });
-//        commands::onDiscord("RESUMED",0,[&](discordmessage &msg) //Resumed
+//        commands::onDiscord("RESUMED",0,[&](const discordmessage &msg) //Resumed
 //        {
 //        });
 
         //Handling discord messages
-        commands::onDiscord("READY",0,[&](discordmessage &msg) //Ready state
+        commands::onDiscord("READY",0,[&](const discordmessage &msg) //Ready state
         {
-            session_id=j::unquote(msg.jsonmsg["d"]["session_id"]);
-            user_id=j::unquote(msg.jsonmsg["d"]["user"]["id"]);
-            disc=j::unquote(msg.jsonmsg["d"]["user"]["discriminator"]);
-            avatar=j::unquote(msg.jsonmsg["d"]["user"]["avatar"]);
+            session_id=j::unquote(j::at(msg.jsonmsg,{"d","session_id"}));
+            {
+                QMutexLocker locker(&discordUsers.mutex);
+                discordUsers.self=j::at(msg.jsonmsg,{"d","user"});
+                discordUsers.changed=true;
+            }
+            user_id=j::unquote(j::at(msg.jsonmsg,{"d","user","id"}));
+            disc=j::unquote(j::at(msg.jsonmsg,{"d","user","discriminator"}));
+            avatar=j::unquote(j::at(msg.jsonmsg,{"d","user","avatar"}));
             QByteArray bot_user_avatar=updateBotAvatar();
             if(!bot_user_avatar.isEmpty())
                 activitylogger::get()->setAvatar(bot_user_avatar);
             activitylogger::get()->setTitle(botname);
             qDebug() << "{READY} Received! : session_id:" << session_id<< "user_id:" << user_id+"#"+disc << "avatar:" << bot_user_avatar.size();
         });
-        commands::onDiscord("GUILD_CREATE",0,[&](discordmessage &msg) //User message
+        commands::onDiscord("GUILD_CREATE",0,[&](const discordmessage &msg) //User message
         {
-            json members=msg.jsonmsg["d"]["members"];
-            for(auto &member : members)
+            if(msg.roster) //Streamed out of the json payload while parsing
+            {
+                for(auto &member : msg.roster->members)
+                    discordUsers.addUserFromGuildCreate(member);
+                for(auto &presence : msg.roster->presences)
+                    discordUsers.updateStatusForUser(presence.id,presence.status);
+                return;
+            }
+            for(auto &member : j::at(msg.jsonmsg,{"d","members"}))
             {
                 discordUsers.addUserFromGuildCreate(member);
             }
-            json presences=msg.jsonmsg["d"]["presences"];
-            for(auto &presence : presences)
+            for(auto &presence : j::at(msg.jsonmsg,{"d","presences"}))
             {
                 discordUsers.updateStatusForUser(presence);
             }
         });
-        commands::onDiscord("MESSAGE_CREATE",0,[&](discordmessage &msg) //User message
+        commands::onDiscord("MESSAGE_CREATE",0,[&](const discordmessage &msg) //User message
         {
             auto user=discordUsers.addUserFromMessage(msg.jsonmsg);
             //if(msg.user.id != user_id)
             activitylogger::dbg(QString("%1: %2").arg(user.name).arg(msg.usermsg));
         });
-        commands::onDiscord("PRESENCE_UPDATE",0,[&](discordmessage &msg) //User message
+        commands::onDiscord("PRESENCE_UPDATE",0,[&](const discordmessage &msg) //User message
         {
-            discordUsers.updateStatusForUser(msg.jsonmsg["d"]);
+            discordUsers.updateStatusForUser(j::at(msg.jsonmsg,{"d"}));
         });
-        commands::onDiscord("VOICE_STATE_UPDATE",0,[&](discordmessage &msg)
+        commands::onDiscord("VOICE_STATE_UPDATE",0,[&](const discordmessage &msg)
         {
-            discorduser u=discordUsers.updateStreamingStatusForUser(msg.jsonmsg["d"]);
+            discorduser u=discordUsers.updateStreamingStatusForUser(j::at(msg.jsonmsg,{"d"}));
             if(updateStreamingStatusesOnChannel=="") updateStreamingStatusesOnChannel=u.last_channel_id;
             if(u.isStreaming)
                 sendTextMessage(updateStreamingStatusesOnChannel,QString("<@%1> just started streaming! Tune in now! :)").arg(u.id));
         });
-//        commands::onDiscord("VOICE_STATE_UPDATE",0,[&](discordmessage &msg)
+//        commands::onDiscord("VOICE_STATE_UPDATE",0,[&](const discordmessage &msg)
 //        {
 //            discorduser u=discordUsers.updateStreamingStatusForUser(msg.jsonmsg["d"]);
 //            if(u.isStreaming)
@@ -1416,15 +2615,15 @@ public:
 //        });
 
         //Handling custom user commands from messages received
-        commands::onCustom("$btc",0,[&](discordmessage &msg)
+        commands::onCustom("$btc",0,[&](const discordmessage &msg)
         {
             CurrentBitcoinValue(msg);
         });
-        commands::onCustom("$stack",0,[&](discordmessage &msg)
+        commands::onCustom("$stack",0,[&](const discordmessage &msg)
         {
             StackOverflowSearch(msg.channel_id,getCommandString(msg));
         });
-        commands::onCustom("$stacknext",0,[&](discordmessage &msg)
+        commands::onCustom("$stacknext",0,[&](const discordmessage &msg)
         {
             auto stack=stackoverflow::get();
             for(auto &q : stack->queries)
@@ -1440,7 +2639,7 @@ public:
             stack->release();
             sendTextMessage(msg.channel_id,"You haven't yet made a query yet... Type: $stack [search query] first!");
         });
-        commands::onCustom("$stackconfig",0,[&](discordmessage &msg)
+        commands::onCustom("$stackconfig",0,[&](const discordmessage &msg)
         {
             QStringList splitMsg=msg.usermsg.split(" ",Qt::SkipEmptyParts);
             for(int i=1; i < splitMsg.size()-1; i++)
@@ -1463,7 +2662,7 @@ public:
             stack->release();
             sendTextMessage(msg.channel_id,QString().asprintf("New results per message limit: %llu and messages per response limit: %llu",resultLimit,msgLimit));
         });
-        commands::onCustom("$git",0,[&](discordmessage &msg)
+        commands::onCustom("$git",0,[&](const discordmessage &msg)
         {
             QString githuburl;
             auto gitcommand=msg.usermsg.split(" ",Qt::SkipEmptyParts);
@@ -1530,7 +2729,7 @@ public:
         bot_instances::release();
         return botavatar;
     }
-    QString getCommandString(discordmessage &msg)
+    QString getCommandString(const discordmessage &msg)
     {
         //Get 'command string' starting from second index after space(s) and then remove any further extra spaces
         QStringList commandAsList=msg.usermsg.split(" ",Qt::SkipEmptyParts);
@@ -1545,65 +2744,62 @@ public:
     }
     void getGateway()
     {
-        httpsclient https;
-        setWebClientConfigForDiscord(https);
-        auto response=https.send(httpsrequest::get("https://"+host+get_gateway_url));
+        auto response=ratelimiter->send(httpsrequest::get(base_url+get_gateway_url));
         if(response.success)
         {
-            qDebug() << "Websocket gateway requested! Response:" << response.text;
+            qDebug() << "Websocket gateway requested! Response:" << response.headers << response.content;
             json js=j::fromQString(response.content);
             QString new_websocket_url=j::unquote(js["url"]);
             if(bot::isNotEmptyOrNull(new_websocket_url))
                 websocket_url=new_websocket_url;
-            qDebug() << "Websocket Url:" << websocket_url;
+            if(js["shards"].is_number() && js["shards"].get<quint32>() > 0)
+                shardcount=js["shards"].get<quint32>();
+            if(js["session_start_limit"]["max_concurrency"].is_number())
+                identifyscheduler::forBot(botkey)->maxconcurrency=js["session_start_limit"]["max_concurrency"].get<quint32>();
+            qDebug() << "Websocket Url:" << websocket_url << "recommended shards:" << shardcount;
         }
     }
     bool sendIsTyping(QString channelId)
     {
         if(bot::isEmptyOrNull(channelId)) return false;
-        httpsclient https;
-        setWebClientConfigForDiscord(https);
-        auto response=https.send(httpsrequest::post("https://"+host+is_typing_url.arg(channelId)));
-        return response.success;
+        ratelimiter->submit(httpsrequest::post(base_url+is_typing_url.arg(channelId)),nullptr);
+        return true;
     }
-    bool sendTextMessage(const QString channelId, const QString message, const QString embeddedTitle="", const QString embeddedMessage="")
+    //Queues the post on the channel's outbox and returns right away, plain text may be merged with neighbouring posts
+    bool sendTextMessage(const QString channelId, const QString message, const QString embeddedTitle="", const QString embeddedMessage="",bool coalescable=true)
     {
         if(bot::isEmptyOrNull(channelId)) return false;
-        httpsclient https;
-        setWebClientConfigForDiscord(https);
-        QString jsonString;
         if(embeddedMessage.isEmpty())
         {
             if(bot::isEmptyOrNull(message)) return false;
-            jsonString=QString(R"({"content":"%1","tts":%2})").arg(message).arg(tts);
+            outbox->postText(channelId,message,coalescable);
         }
         else
         {
-            jsonString=QString(R"({"content":"%1","tts":%2,"embed":{"title":"%3","description":"%4"}})").arg(message).arg(tts).arg(embeddedTitle).arg(embeddedMessage);
+            outboundpost post;
+            post.request=httpsrequest::post(base_url+post_message_url.arg(channelId),
+                            QString(R"({"content":"%1","tts":%2,"embed":{"title":"%3","description":"%4"}})").arg(message).arg(tts).arg(embeddedTitle).arg(embeddedMessage));
+            outbox->postRequest(channelId,post);
         }
-
-        auto response=https.send(httpsrequest::post("https://"+host+post_message_url.arg(channelId),jsonString));
-        return response.success;
+        return true;
     }
 
     bool sendTextFile(QString channelId,QString filename,QByteArray textfile,QString message="")
     {
-        httpsclient https;
-        setWebClientConfigForDiscord(https);
-        auto request=httpsrequest::post("https://"+host+post_message_url.arg(channelId));
+        auto request=httpsrequest::post(base_url+post_message_url.arg(channelId));
         QByteArray payload_json=QString("{\"tts\":false,\"content\":\"%1\"}").arg(message).toUtf8();
         request.addMultiPartData(httpsrequest::multipart::TEXT,"payload_json",payload_json);
         request.addMultiPartData(httpsrequest::multipart::OCTET_STREAM,filename,textfile);
 
-        auto response=https.send(request);
-        return response.success;
+        outboundpost post;
+        post.request=request;
+        outbox->postRequest(channelId,post);
+        return true;
     }
 
     bool sendImageFile(QString channelId,QString filename,QByteArray imgfile,QString message="")
     {
-        httpsclient https;
-        setWebClientConfigForDiscord(https);
-        auto request=httpsrequest::post("https://"+host+post_message_url.arg(channelId));
+        auto request=httpsrequest::post(base_url+post_message_url.arg(channelId));
         QByteArray payload_json=QString("{\"tts\":%1,\"content\":\"%2\"}").arg(tts).arg(message).toUtf8();
         request.addMultiPartData(httpsrequest::multipart::TEXT,"payload_json",payload_json);
         QString fileExtension=bot::getFileExtension(filename);
@@ -1616,8 +2812,10 @@ public:
         else
             request.addMultiPartData(httpsrequest::multipart::OCTET_STREAM,filename,imgfile);
 
-        auto response=https.send(request);
-        return response.success;
+        outboundpost post;
+        post.request=request;
+        outbox->postRequest(channelId,post);
+        return true;
     }
 
     bool sendImageFromFile(QString channelId,QString filename,QString filepath,QString message="")
@@ -1731,7 +2929,7 @@ public:
         stackoverflow::get()->doSearch(channelId,txtquery);
         stackoverflow::release();
     }
-    void CurrentBitcoinValue(discordmessage &msg)
+    void CurrentBitcoinValue(const discordmessage &msg)
     {
         QString amountOfBtcString=getCommandString(msg);
         if(amountOfBtcString.isEmpty())
@@ -1817,6 +3015,12 @@ public:
         size_t numbots=bots.size();
         bots.clear();
         bot_instances::free();
+        activitylogger::dbg(httpsconnectionpool::report());
+        activitylogger::dbg(httpsresolver::report());
+        activitylogger::dbg(httpssessioncache::report());
+        activitylogger::dbg(httpscache::report());
+        activitylogger::dbg(discordratelimiter::reportAll());
+        httpsio::stop();
         activitylogger::dbg(QString("%1 discord bot instances stopped...").arg(numbots));
     }
     botcommander(botcommander&)=delete;
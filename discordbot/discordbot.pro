@@ -6,6 +6,12 @@ CONFIG += c++17
 INCLUDEPATH += $$[QT_INSTALL_HEADERS]/QtZlib
 #LIBS += -lz
 PKGCONFIG += openssl
+# Brotli is optional, without it "br" is simply not advertised in Accept-Encoding
+packagesExist(libbrotlidec libbrotlienc) {
+    CONFIG += link_pkgconfig
+    PKGCONFIG += libbrotlidec libbrotlienc
+    DEFINES += QCOMPRESSOR_BROTLI
+}
 
 # The following define makes your compiler emit warnings if you use
 # any Qt feature that has been marked deprecated (the exact warnings
@@ -26,12 +32,18 @@ SOURCES += \
 
 HEADERS += \
     botsetupui.h \
+    crc32.h \
     discordbot.h \
     discordbotui.h \
+    etf.h \
     eventviewerui.h \
+    fasthash.h \
+    gatewaycapture.h \
     httpsclient.h \
     json.hpp \
+    mpmcqueue.h \
     qcompressor.h \
+    ratelimiter.h \
     suspendable.h
 
 FORMS += \
@@ -0,0 +1,377 @@
+#ifndef ETF_H
+#define ETF_H
+
+#include <QByteArray>
+#include <QtEndian>
+#include <zlib.h>
+#include <cstring>
+#include <string>
+#include "json.hpp"
+
+//Erlang external term format as the discord gateway speaks it with encoding=etf, straight to and from nlohmann::json
+//Decoding gives the same shape the json gateway does: maps become objects, binaries strings, nil null and
+//big integers (snowflakes) decimal strings just like the json payloads carry them
+class etf
+{
+public:
+    enum tag : quint8
+    {
+        NEW_FLOAT_EXT=70,
+        BIT_BINARY_EXT=77,
+        COMPRESSED=80,
+        SMALL_INTEGER_EXT=97,
+        INTEGER_EXT=98,
+        FLOAT_EXT=99,
+        ATOM_EXT=100,
+        SMALL_TUPLE_EXT=104,
+        LARGE_TUPLE_EXT=105,
+        NIL_EXT=106,
+        STRING_EXT=107,
+        LIST_EXT=108,
+        BINARY_EXT=109,
+        SMALL_BIG_EXT=110,
+        LARGE_BIG_EXT=111,
+        MAP_EXT=116,
+        ATOM_UTF8_EXT=118,
+        SMALL_ATOM_UTF8_EXT=119,
+    };
+    static constexpr quint8 version=131;
+    inline static int maxdepth=256;
+    inline static quint32 maxinflated=64*1024*1024; //Largest size a compressed term may claim to inflate to
+
+    inline static bool decode(const char *data,qint64 size,nlohmann::json &out)
+    {
+        reader r{(const quint8*)data,(const quint8*)data+size};
+        if(r.u8()!=version) return false;
+        out=term(r,0);
+        return r.ok && r.p==r.end;
+    }
+    inline static bool decode(const QByteArray &data,nlohmann::json &out) { return decode(data.constData(),data.size(),out); }
+    //Reads only the top level op, t and s of a gateway payload (s is -1 when null), skipping over everything else without building it
+    inline static bool peek(const char *data,qint64 size,int &op,std::string &t,qint64 &s)
+    {
+        reader r{(const quint8*)data,(const quint8*)data+size};
+        if(r.u8()!=version || r.u8()!=MAP_EXT) return false;
+        bool hasop=false,hast=false,hass=false;
+        t.clear();
+        s=-1;
+        for(quint32 n=r.u32(); n > 0 && r.ok && !(hasop && hast && hass); n--)
+        {
+            nlohmann::json key=term(r,maxdepth); //Keys are atoms, decoding them is cheap
+            if(key=="op")
+            {
+                nlohmann::json value=term(r,maxdepth);
+                hasop=value.is_number_integer();
+                op=(hasop ? value.get<int>() : -1);
+            }
+            else if(key=="t")
+            {
+                nlohmann::json value=term(r,maxdepth);
+                hast=true;
+                t=(value.is_string() ? value.get<std::string>() : std::string());
+            }
+            else if(key=="s")
+            {
+                nlohmann::json value=term(r,maxdepth);
+                hass=true;
+                s=(value.is_number_integer() ? value.get<qint64>() : -1);
+            }
+            else
+                skip(r,0);
+        }
+        return r.ok && hasop;
+    }
+    inline static QByteArray encode(const nlohmann::json &value)
+    {
+        QByteArray out;
+        out.reserve(256);
+        out.append((char)version);
+        write(out,value);
+        return out;
+    }
+private:
+    class reader
+    {
+    public:
+        const quint8 *p,*end;
+        bool ok=true;
+        bool need(qint64 n)
+        {
+            if(ok && end-p >= n) return true;
+            ok=false;
+            return false;
+        }
+        quint8 u8() { return need(1) ? *p++ : 0; }
+        quint16 u16()
+        {
+            if(!need(2)) return 0;
+            quint16 v=qFromBigEndian<quint16>(p);
+            p+=2;
+            return v;
+        }
+        quint32 u32()
+        {
+            if(!need(4)) return 0;
+            quint32 v=qFromBigEndian<quint32>(p);
+            p+=4;
+            return v;
+        }
+        std::string bytes(qint64 n)
+        {
+            if(!need(n)) return std::string();
+            std::string s((const char*)p,(size_t)n);
+            p+=n;
+            return s;
+        }
+    };
+    inline static nlohmann::json atom(std::string name)
+    {
+        if(name=="nil" || name=="null") return nullptr;
+        if(name=="true") return true;
+        if(name=="false") return false;
+        return name;
+    }
+    inline static nlohmann::json big(reader &r,quint32 n)
+    {
+        quint8 sign=r.u8();
+        if(n > 8)
+        {
+            r.ok=false; //Nothing discord sends needs more than 64 bits
+            return nullptr;
+        }
+        if(!r.need(n)) return nullptr;
+        quint64 value=0;
+        for(quint32 i=0; i < n; i++)
+            value|=quint64(r.p[i]) << (8*i);
+        r.p+=n;
+        std::string digits=std::to_string(value);
+        return sign ? "-"+digits : digits;
+    }
+    inline static nlohmann::json term(reader &r,int depth)
+    {
+        if(depth > maxdepth)
+        {
+            r.ok=false;
+            return nullptr;
+        }
+        switch(r.u8())
+        {
+        case SMALL_INTEGER_EXT: return r.u8();
+        case INTEGER_EXT: return (qint32)r.u32();
+        case NEW_FLOAT_EXT:
+        {
+            quint64 bits=quint64(r.u32()) << 32;
+            bits|=r.u32();
+            double d;
+            memcpy(&d,&bits,sizeof(d));
+            return d;
+        }
+        case FLOAT_EXT: return strtod(r.bytes(31).c_str(),nullptr);
+        case ATOM_EXT:
+        case ATOM_UTF8_EXT: return atom(r.bytes(r.u16()));
+        case SMALL_ATOM_UTF8_EXT: return atom(r.bytes(r.u8()));
+        case NIL_EXT: return nlohmann::json::array();
+        case STRING_EXT: //Erlang's compact list of small integers
+        {
+            nlohmann::json list=nlohmann::json::array();
+            for(char c : r.bytes(r.u16()))
+                list.push_back((quint8)c);
+            return list;
+        }
+        case BINARY_EXT: return r.bytes(r.u32());
+        case SMALL_BIG_EXT: return big(r,r.u8());
+        case LARGE_BIG_EXT: return big(r,r.u32());
+        case SMALL_TUPLE_EXT:
+        case LARGE_TUPLE_EXT:
+        case LIST_EXT:
+        {
+            quint8 t=r.p[-1];
+            quint32 n=(t==SMALL_TUPLE_EXT ? r.u8() : r.u32());
+            nlohmann::json list=nlohmann::json::array();
+            for(quint32 i=0; i < n && r.ok; i++)
+                list.push_back(term(r,depth+1));
+            if(t==LIST_EXT && r.ok)
+            {
+                nlohmann::json tail=term(r,depth+1); //Proper lists end in NIL_EXT
+                if(!tail.is_array() || !tail.empty())
+                    list.push_back(tail);
+            }
+            return list;
+        }
+        case MAP_EXT:
+        {
+            quint32 n=r.u32();
+            nlohmann::json map=nlohmann::json::object();
+            for(quint32 i=0; i < n && r.ok; i++)
+            {
+                nlohmann::json key=term(r,depth+1);
+                nlohmann::json value=term(r,depth+1);
+                map[key.is_string() ? key.get<std::string>() : key.dump()]=std::move(value);
+            }
+            return map;
+        }
+        case COMPRESSED:
+        {
+            uLongf size=r.u32();
+            qint64 available=r.end-r.p;
+            //Checked before allocating: deflate can't expand more than about 1032:1, and nothing discord sends gets near the cap
+            if(!r.ok || size > maxinflated || (quint64)size > (quint64)available*1032+64)
+            {
+                r.ok=false;
+                return nullptr;
+            }
+            std::string inflated(size,'\0');
+            std::string packed=r.bytes(available);
+            if(!r.ok || uncompress((Bytef*)&inflated[0],&size,(const Bytef*)packed.data(),(uLong)packed.size())!=Z_OK)
+            {
+                r.ok=false;
+                return nullptr;
+            }
+            reader inner{(const quint8*)inflated.data(),(const quint8*)inflated.data()+size};
+            nlohmann::json value=term(inner,depth+1);
+            r.ok=inner.ok && inner.p==inner.end;
+            return value;
+        }
+        default:
+            r.ok=false;
+            return nullptr;
+        }
+    }
+    inline static void skip(reader &r,int depth)
+    {
+        if(depth > maxdepth)
+        {
+            r.ok=false;
+            return;
+        }
+        quint64 n=0,items=0;
+        switch(r.u8())
+        {
+        case SMALL_INTEGER_EXT: n=1; break;
+        case INTEGER_EXT: n=4; break;
+        case NEW_FLOAT_EXT: n=8; break;
+        case FLOAT_EXT: n=31; break;
+        case ATOM_EXT:
+        case ATOM_UTF8_EXT: n=r.u16(); break;
+        case SMALL_ATOM_UTF8_EXT: n=r.u8(); break;
+        case NIL_EXT: break;
+        case STRING_EXT: n=r.u16(); break;
+        case BINARY_EXT: n=r.u32(); break;
+        case SMALL_BIG_EXT: n=r.u8()+1; break;
+        case LARGE_BIG_EXT: n=quint64(r.u32())+1; break;
+        case SMALL_TUPLE_EXT: items=r.u8(); break;
+        case LARGE_TUPLE_EXT: items=r.u32(); break;
+        case LIST_EXT: items=quint64(r.u32())+1; break; //Elements plus the tail
+        case MAP_EXT: items=quint64(r.u32())*2; break;
+        default: r.ok=false; return;
+        }
+        if(r.need(n))
+            r.p+=n;
+        for(; items > 0 && r.ok; items--)
+            skip(r,depth+1);
+    }
+    inline static void u8(QByteArray &out,quint8 v) { out.append((char)v); }
+    inline static void u16(QByteArray &out,quint16 v)
+    {
+        char b[2];
+        qToBigEndian(v,b);
+        out.append(b,2);
+    }
+    inline static void u32(QByteArray &out,quint32 v)
+    {
+        char b[4];
+        qToBigEndian(v,b);
+        out.append(b,4);
+    }
+    inline static void atom(QByteArray &out,const char *name)
+    {
+        quint8 n=(quint8)strlen(name);
+        u8(out,SMALL_ATOM_UTF8_EXT);
+        u8(out,n);
+        out.append(name,n);
+    }
+    inline static void integer(QByteArray &out,quint64 magnitude,bool negative)
+    {
+        if(!negative && magnitude <= 0xff)
+        {
+            u8(out,SMALL_INTEGER_EXT);
+            u8(out,(quint8)magnitude);
+        }
+        else if(magnitude <= (negative ? 0x80000000ull : 0x7fffffffull))
+        {
+            u8(out,INTEGER_EXT);
+            u32(out,negative ? quint32(0-magnitude) : quint32(magnitude));
+        }
+        else
+        {
+            quint8 digits[8],n=0;
+            for(; magnitude; magnitude>>=8)
+                digits[n++]=(quint8)(magnitude&0xff);
+            u8(out,SMALL_BIG_EXT);
+            u8(out,n);
+            u8(out,negative ? 1 : 0);
+            out.append((const char*)digits,n);
+        }
+    }
+    inline static void write(QByteArray &out,const nlohmann::json &value)
+    {
+        switch(value.type())
+        {
+        case nlohmann::json::value_t::null: atom(out,"nil"); break;
+        case nlohmann::json::value_t::boolean: atom(out,value.get<bool>() ? "true" : "false"); break;
+        case nlohmann::json::value_t::number_unsigned: integer(out,value.get<quint64>(),false); break;
+        case nlohmann::json::value_t::number_integer:
+        {
+            qint64 v=value.get<qint64>();
+            integer(out,v < 0 ? 0-quint64(v) : quint64(v),v < 0);
+            break;
+        }
+        case nlohmann::json::value_t::number_float:
+        {
+            double d=value.get<double>();
+            quint64 bits;
+            memcpy(&bits,&d,sizeof(bits));
+            u8(out,NEW_FLOAT_EXT);
+            u32(out,quint32(bits >> 32));
+            u32(out,quint32(bits));
+            break;
+        }
+        case nlohmann::json::value_t::string:
+        {
+            const std::string &s=value.get_ref<const std::string&>();
+            u8(out,BINARY_EXT);
+            u32(out,(quint32)s.size());
+            out.append(s.data(),(int)s.size());
+            break;
+        }
+        case nlohmann::json::value_t::array:
+            if(value.empty())
+            {
+                u8(out,NIL_EXT);
+                break;
+            }
+            u8(out,LIST_EXT);
+            u32(out,(quint32)value.size());
+            for(auto &element : value)
+                write(out,element);
+            u8(out,NIL_EXT);
+            break;
+        case nlohmann::json::value_t::object:
+            u8(out,MAP_EXT);
+            u32(out,(quint32)value.size());
+            for(auto it=value.begin(); it!=value.end(); ++it)
+            {
+                u8(out,BINARY_EXT);
+                u32(out,(quint32)it.key().size());
+                out.append(it.key().data(),(int)it.key().size());
+                write(out,it.value());
+            }
+            break;
+        default:
+            atom(out,"nil");
+            break;
+        }
+    }
+};
+
+#endif // ETF_H
@@ -0,0 +1,111 @@
+#ifndef FASTHASH_H
+#define FASTHASH_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QString>
+#include <cstring>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//64-bit non-cryptographic hash for the hot path (wyhash final version 4.2 by Wang Yi, public domain),
+//several GB/s and plenty for dedupe and lookup keys where sha-256 was overkill.
+//Values are only meant to be compared within the same process
+class fasthash
+{
+public:
+    inline static quint64 hash(const void *key,size_t len,quint64 seed=0)
+    {
+        const uchar *p=(const uchar*)key;
+        seed^=mix(seed^secret[0],secret[1]);
+        quint64 a,b;
+        if(len <= 16)
+        {
+            if(len >= 4)
+            {
+                a=(r4(p) << 32)|r4(p+((len >> 3) << 2));
+                b=(r4(p+len-4) << 32)|r4(p+len-4-((len >> 3) << 2));
+            }
+            else if(len > 0)
+            {
+                a=(quint64(p[0]) << 16)|(quint64(p[len >> 1]) << 8)|p[len-1];
+                b=0;
+            }
+            else
+                a=b=0;
+        }
+        else
+        {
+            size_t i=len;
+            if(i > 48)
+            {
+                quint64 see1=seed,see2=seed;
+                do
+                {
+                    seed=mix(r8(p)^secret[1],r8(p+8)^seed);
+                    see1=mix(r8(p+16)^secret[2],r8(p+24)^see1);
+                    see2=mix(r8(p+32)^secret[3],r8(p+40)^see2);
+                    p+=48;
+                    i-=48;
+                } while(i > 48);
+                seed^=see1^see2;
+            }
+            while(i > 16)
+            {
+                seed=mix(r8(p)^secret[1],r8(p+8)^seed);
+                i-=16;
+                p+=16;
+            }
+            a=r8(p+i-16);
+            b=r8(p+i-8);
+        }
+        a^=secret[1];
+        b^=seed;
+        multiply(a,b);
+        return mix(a^secret[0]^len,b^secret[1]);
+    }
+    inline static quint64 of(const QByteArray &data,quint64 seed=0) { return hash(data.constData(),data.size(),seed); }
+    //Hashes the utf-16 code units as they are, no utf-8 conversion
+    inline static quint64 of(const QString &text,quint64 seed=0) { return hash(text.constData(),text.size()*sizeof(QChar),seed); }
+private:
+    static constexpr quint64 secret[4]={0x2d358dccaa6c78a5ull,0x8bb84b93962eacc9ull,0x4b33a62ed433d4a3ull,0x4d5a2da51de1aa47ull};
+    inline static void multiply(quint64 &a,quint64 &b)
+    {
+#if defined(__SIZEOF_INT128__)
+        __uint128_t r=a;
+        r*=b;
+        a=(quint64)r;
+        b=(quint64)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+        a=_umul128(a,b,&b);
+#else
+        quint64 ha=a >> 32,hb=b >> 32,la=(quint32)a,lb=(quint32)b;
+        quint64 rh=ha*hb,rm0=ha*lb,rm1=hb*la,rl=la*lb,t=rl+(rm0 << 32),c=t < rl;
+        quint64 lo=t+(rm1 << 32);
+        c+=lo < t;
+        quint64 hi=rh+(rm0 >> 32)+(rm1 >> 32)+c;
+        a=lo;
+        b=hi;
+#endif
+    }
+    inline static quint64 mix(quint64 a,quint64 b)
+    {
+        multiply(a,b);
+        return a^b;
+    }
+    inline static quint64 r8(const uchar *p)
+    {
+        quint64 v;
+        memcpy(&v,p,8);
+        return v;
+    }
+    inline static quint64 r4(const uchar *p)
+    {
+        quint32 v;
+        memcpy(&v,p,4);
+        return v;
+    }
+};
+
+#endif // FASTHASH_H
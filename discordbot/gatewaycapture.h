@@ -0,0 +1,141 @@
+#ifndef GATEWAYCAPTURE_H
+#define GATEWAYCAPTURE_H
+
+#include <QFile>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QtEndian>
+#include <QDebug>
+#include <atomic>
+#include <cstring>
+
+//Raw gateway payloads as the worker got them (after zlib-stream inflate, before any filtering), to replay production traffic offline.
+//File: "DGWC", u8 version, u16 shard count, then per payload: u64 microseconds since the capture started, u16 shard,
+//u8 kind, u32 size and the payload bytes, all little endian
+class gatewaycapture
+{
+public:
+    enum kind : quint8 { TEXT, ETF };
+    static constexpr quint8 version=1;
+    static constexpr int headersize=4+1+2,framesize=8+2+1+4;
+    class frame
+    {
+    public:
+        qint64 micros=0;
+        quint16 shard=0;
+        kind type=TEXT;
+        QByteArray payload;
+    };
+    inline static QByteArray magic() { return QByteArray("DGWC",4); }
+};
+
+//Shared by every shard of a bot, frames are buffered and go to disk in big writes
+class gatewayrecorder
+{
+private:
+    QMutex mutex;
+    QFile file;
+    QByteArray buffer;
+    QElapsedTimer clock;
+    void flushLocked()
+    {
+        if(!buffer.isEmpty() && file.isOpen())
+            file.write(buffer);
+        buffer.resize(0);
+    }
+public:
+    inline static int bufferSize=256*1024;
+    std::atomic<quint64> frames=0,bytes=0;
+    ~gatewayrecorder() { close(); }
+    bool open(QString path,quint16 shardcount)
+    {
+        QMutexLocker locker(&mutex);
+        file.setFileName(path);
+        if(!file.open(QIODevice::WriteOnly|QIODevice::Truncate))
+        {
+            qDebug() << "Could not open gateway capture file:" << path;
+            return false;
+        }
+        char header[gatewaycapture::headersize];
+        memcpy(header,gatewaycapture::magic().constData(),4);
+        header[4]=(char)gatewaycapture::version;
+        qToLittleEndian<quint16>(shardcount,header+5);
+        file.write(header,sizeof(header));
+        buffer.reserve(bufferSize);
+        clock.start();
+        qDebug() << "Recording gateway traffic to:" << path;
+        return true;
+    }
+    void record(quint16 shard,gatewaycapture::kind type,const char *data,qint64 size)
+    {
+        char header[gatewaycapture::framesize];
+        QMutexLocker locker(&mutex);
+        if(!file.isOpen()) return;
+        qToLittleEndian<quint64>(clock.nsecsElapsed()/1000,header);
+        qToLittleEndian<quint16>(shard,header+8);
+        header[10]=(char)type;
+        qToLittleEndian<quint32>((quint32)size,header+11);
+        buffer.append(header,sizeof(header));
+        buffer.append(data,size);
+        frames++;
+        bytes+=size;
+        if(buffer.size() >= bufferSize)
+            flushLocked();
+    }
+    void record(quint16 shard,gatewaycapture::kind type,const QByteArray &payload) { record(shard,type,payload.constData(),payload.size()); }
+    void flush()
+    {
+        QMutexLocker locker(&mutex);
+        flushLocked();
+        file.flush();
+    }
+    void close()
+    {
+        QMutexLocker locker(&mutex);
+        flushLocked();
+        file.close();
+    }
+};
+
+class gatewayreader
+{
+private:
+    QFile file;
+public:
+    quint16 shardcount=1;
+    bool open(QString path)
+    {
+        file.setFileName(path);
+        if(!file.open(QIODevice::ReadOnly))
+            return false;
+        QByteArray header=file.read(gatewaycapture::headersize);
+        if(header.size()!=gatewaycapture::headersize || !header.startsWith(gatewaycapture::magic()) || (quint8)header[4]!=gatewaycapture::version)
+        {
+            qDebug() << "Not a gateway capture file:" << path;
+            file.close();
+            return false;
+        }
+        shardcount=qMax<quint16>(1,qFromLittleEndian<quint16>(header.constData()+5));
+        return true;
+    }
+    //False at the end of the capture or on a truncated frame, whose size is checked against the rest of the file before reading
+    bool next(gatewaycapture::frame &f)
+    {
+        char header[gatewaycapture::framesize];
+        if(file.read(header,sizeof(header))!=sizeof(header))
+            return false;
+        f.micros=(qint64)qFromLittleEndian<quint64>(header);
+        f.shard=qFromLittleEndian<quint16>(header+8);
+        f.type=(gatewaycapture::kind)header[10];
+        quint32 size=qFromLittleEndian<quint32>(header+11);
+        if(size > (quint64)file.bytesAvailable())
+        {
+            qDebug() << "Gateway capture is truncated or corrupt at offset" << file.pos() << "frame claims" << size << "bytes";
+            return false;
+        }
+        f.payload=file.read(size);
+        return f.payload.size()==(int)size;
+    }
+};
+
+#endif // GATEWAYCAPTURE_H
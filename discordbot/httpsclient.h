@@ -2,9 +2,28 @@
 #define HTTPSCLIENT_H
 
 #include <QSslSocket>
+#include <QSslConfiguration>
+#include <QHostInfo>
+#include <QHostAddress>
+#include <QPointer>
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QDir>
+#include <QFile>
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <QRandomGenerator>
+#include <QThread>
+#include <QMutex>
+#include <QHash>
+#include <QVector>
 #include <QString>
+#include <QTimer>
+#include <QEventLoop>
+#include <future>
+#include <memory>
+#include <list>
+#include "suspendable.h"
 #include "qcompressor.h"
 
 class cookiecontainer
@@ -72,7 +91,7 @@ public:
         userAgent="Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:75.0) Gecko/20100101 Firefox/75.0"; //Default user agent string: x64 win10 firefox 75.0
         accept="text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8";
         acceptLanguage="en-US,en;q=0.5";
-        acceptEncoding="gzip, deflate, br";
+        acceptEncoding=QCompressorStream::acceptEncoding();
         referer="";
         origin="";
         dnt="1";
@@ -205,12 +224,279 @@ private:
     }
 };
 
+using httpsconsumer=std::function<void(const char *data,qint64 size)>;
+
+//Single pass resumable HTTP/1.1 response parser, feed it whatever the socket hands over and every byte is looked at once
+//Header names are stored lowercased, the body goes into a preallocated buffer or straight to a consumer
+class httpsparser
+{
+public:
+    enum class state
+    {
+        STATUS,
+        HEADERS,
+        BODY,
+        CHUNKSIZE,
+        CHUNKDATA,
+        CHUNKEND,
+        TRAILERS,
+        UNTILCLOSE,
+        DONE,
+        FAILED,
+    };
+    state current=state::STATUS;
+    int status=0;
+    QByteArray version,reason,rawheaders,content;
+    QHash<QByteArray,QByteArray> headers,trailers;
+    qint64 contentlength=-1,remaining=0;
+    bool chunked=false,nobody=false,untilclose=false;
+    bool decode=false; //Undo Content-Encoding while the body arrives, content/consumer then see the decoded bytes
+    httpsconsumer consumer;
+    inline static int maxlinesize=0x10000;
+
+    void reset()
+    {
+        current=state::STATUS;
+        status=0;
+        version.clear();
+        reason.clear();
+        rawheaders.clear();
+        content.clear();
+        headers.clear();
+        trailers.clear();
+        line.clear();
+        contentlength=-1;
+        remaining=0;
+        chunked=nobody=untilclose=decodingbody=false;
+    }
+    bool decoding() const { return decodingbody; }
+    qint64 encodedSize() const { return (decodingbody ? decoder->totalIn() : content.size()); }
+    bool done() const { return current==state::DONE; }
+    bool failed() const { return current==state::FAILED; }
+    bool headersDone() const { return current!=state::STATUS && current!=state::HEADERS && current!=state::FAILED; }
+    QByteArray header(const QByteArray &name) const { return headers.value(name.toLower()); }
+    bool keepAlive() const
+    {
+        QByteArray connection=header("connection").toLower();
+        if(version=="HTTP/1.0") return connection.contains("keep-alive");
+        return !connection.contains("close");
+    }
+    //Returns how much of data was used, anything left over once done doesn't belong to this response
+    qint64 feed(const char *data,qint64 size)
+    {
+        const char *p=data,*end=data+size;
+        while(p < end && current!=state::DONE && current!=state::FAILED)
+        {
+            switch(current)
+            {
+            case state::STATUS:
+            case state::HEADERS:
+            case state::CHUNKSIZE:
+            case state::CHUNKEND:
+            case state::TRAILERS:
+            {
+                const char *newline=(const char*)memchr(p,'\n',end-p);
+                const char *lineend=(newline ? newline : end);
+                if(line.size()+(lineend-p) > maxlinesize)
+                {
+                    current=state::FAILED;
+                    break;
+                }
+                line.append(p,lineend-p);
+                if(current==state::STATUS || current==state::HEADERS)
+                    rawheaders.append(p,(newline ? newline+1 : end)-p);
+                p=(newline ? newline+1 : end);
+                if(newline)
+                {
+                    if(line.endsWith('\r')) line.chop(1);
+                    onLine();
+                    line.clear();
+                }
+                break;
+            }
+            case state::BODY:
+            case state::CHUNKDATA:
+            {
+                qint64 n=qMin<qint64>(remaining,end-p);
+                if(!deliver(p,n))
+                {
+                    current=state::FAILED;
+                    break;
+                }
+                p+=n;
+                remaining-=n;
+                if(remaining==0)
+                    current=(current==state::BODY ? state::DONE : state::CHUNKEND);
+                break;
+            }
+            case state::UNTILCLOSE:
+                if(!deliver(p,end-p))
+                {
+                    current=state::FAILED;
+                    break;
+                }
+                p=end;
+                break;
+            default:
+                break;
+            }
+        }
+        return p-data;
+    }
+    //Connection closed, only a body delimited by the close itself can finish here
+    void finish()
+    {
+        if(current==state::UNTILCLOSE)
+            current=state::DONE;
+        else if(current!=state::DONE)
+            current=state::FAILED;
+    }
+private:
+    QByteArray line,decoded;
+    std::unique_ptr<QCompressorStream> decoder; //Kept across responses so keep-alive reuse doesn't reallocate the inflate state
+    bool decodingbody=false;
+    bool deliver(const char *data,qint64 size)
+    {
+        if(size <= 0) return true;
+        if(decodingbody)
+        {
+            if(!decoder->push(data,size,consumer ? decoded : content))
+                return false;
+            if(consumer && !decoded.isEmpty())
+            {
+                consumer(decoded.constData(),decoded.size());
+                decoded.resize(0);
+            }
+        }
+        else if(consumer)
+            consumer(data,size);
+        else
+            content.append(data,size);
+        return true;
+    }
+    void onLine()
+    {
+        switch(current)
+        {
+        case state::STATUS:
+        {
+            if(line.isEmpty()) return; //Tolerate stray empty lines before the status line
+            int firstspace=line.indexOf(' ');
+            if(firstspace==-1 || !line.startsWith("HTTP/"))
+            {
+                current=state::FAILED;
+                return;
+            }
+            int secondspace=line.indexOf(' ',firstspace+1);
+            version=line.left(firstspace);
+            status=line.mid(firstspace+1,(secondspace==-1 ? line.size() : secondspace)-(firstspace+1)).toInt();
+            reason=(secondspace==-1 ? QByteArray() : line.mid(secondspace+1));
+            current=state::HEADERS;
+            return;
+        }
+        case state::HEADERS:
+            if(line.isEmpty())
+                onHeadersDone();
+            else
+                addField(headers);
+            return;
+        case state::CHUNKSIZE:
+        {
+            int extension=line.indexOf(';');
+            bool ok=false;
+            remaining=(extension==-1 ? line : line.left(extension)).trimmed().toLongLong(&ok,16);
+            if(!ok || remaining < 0)
+                current=state::FAILED;
+            else if(remaining==0)
+                current=state::TRAILERS;
+            else
+            {
+                if(!consumer && !decodingbody) content.reserve(content.size()+remaining);
+                current=state::CHUNKDATA;
+            }
+            return;
+        }
+        case state::CHUNKEND:
+            current=(line.isEmpty() ? state::CHUNKSIZE : state::FAILED);
+            return;
+        case state::TRAILERS:
+            if(line.isEmpty())
+                current=state::DONE;
+            else
+                addField(trailers);
+            return;
+        default:
+            return;
+        }
+    }
+    void addField(QHash<QByteArray,QByteArray> &fields)
+    {
+        int colon=line.indexOf(':');
+        if(colon <= 0) return;
+        QByteArray name=line.left(colon).trimmed().toLower();
+        QByteArray value=line.mid(colon+1).trimmed();
+        auto it=fields.find(name);
+        if(it==fields.end())
+            fields.insert(name,value);
+        else
+            it.value()+=", "+value;
+    }
+    void onHeadersDone()
+    {
+        if(status >= 100 && status < 200) //Informational, the real response follows
+        {
+            reset();
+            return;
+        }
+        chunked=header("transfer-encoding").toLower().contains("chunked");
+        QByteArray length=header("content-length");
+        if(!length.isEmpty())
+            contentlength=length.toLongLong();
+        nobody=(status==204 || status==304);
+        QCompressorStream::format encoding=QCompressorStream::fromContentEncoding(header("content-encoding"));
+        decodingbody=(decode && !nobody && encoding!=QCompressorStream::format::IDENTITY && QCompressorStream::supported(encoding));
+        if(decodingbody)
+        {
+            if(!decoder || decoder->type()!=encoding)
+                decoder=std::make_unique<QCompressorStream>(encoding);
+            else
+                decoder->reset();
+            if(contentlength > 0)
+                decoder->setSizeHint(contentlength*4);
+        }
+        if(nobody || (!chunked && contentlength==0))
+            current=state::DONE;
+        else if(chunked)
+            current=state::CHUNKSIZE;
+        else if(contentlength > 0)
+        {
+            remaining=contentlength;
+            if(!consumer && !decodingbody) content.reserve(contentlength);
+            current=state::BODY;
+        }
+        else
+        {
+            untilclose=true;
+            current=state::UNTILCLOSE;
+        }
+    }
+};
+
 class httpsresponse
 {
 public:
     QByteArray text,headers,content,uncompressed;
+    QHash<QByteArray,QByteArray> fields;
+    int status=0;
     bool success=false;
     httpsresponse() { }
+    httpsresponse(httpsparser &parser)
+    {
+        setresponse(parser.rawheaders,parser.content);
+        fields=parser.headers;
+        status=parser.status;
+    }
+    QByteArray header(const QByteArray &name) const { return fields.value(name.toLower()); }
     httpsresponse(QByteArray bytes)
     {
         setresponse(bytes);
@@ -246,168 +532,798 @@ public:
     }
 };
 
-class httpsclient : public QObject
+//Keeps already established sockets around per bot (authorization) and host so requests can skip the tcp/tls handshake
+//Every socket lives on the httpsio thread, the pool is only ever touched from there so it needs no locking
+class httpsconnection
+{
+public:
+    QSslSocket *ssl=nullptr;
+    qint64 lastused=0;
+    QMetaObject::Connection onreadyread,ondisconnected;
+};
+
+class httpsconnectionpool
 {
-    Q_OBJECT
 private:
-    QSslSocket ssl;
-    bool connected=false,usecompression=true,keepalive=true;
-    int waittime=2000,readsize=0x4000,numretries=3;
-    QString authorization,useragent;
-    QByteArray compressedcontent,compressedrequest,uncompressedcontent,uncompressedresponse;
-    bool open(httpsrequest &request)
+    inline static QHash<QString,QVector<httpsconnection>> idle;
+    inline static void unwatch(httpsconnection &c)
     {
-        keepalive=request.keepalive;
-        if(request.proto==httpsrequest::protocol::HTTPS)
+        QObject::disconnect(c.onreadyread);
+        QObject::disconnect(c.ondisconnected);
+    }
+    inline static void discard(QSslSocket *ssl)
+    {
+        ssl->abort();
+        ssl->deleteLater();
+    }
+    //Anything readable on an idle connection is either a close or data nobody asked for
+    inline static void drop(const QString &key,QSslSocket *ssl)
+    {
+        auto it=idle.find(key);
+        if(it==idle.end()) return;
+        for(int i=0; i < it->size(); i++)
         {
-            ssl.connectToHostEncrypted(request.host,request.port);
-            if(!ssl.waitForEncrypted())
+            if((*it)[i].ssl==ssl)
             {
-                qDebug() << "httpsclient error:" << ssl.errorString() << "error:" << ssl.error();
-                return connected=false;
+                unwatch((*it)[i]);
+                it->removeAt(i);
+                evictions++;
+                discard(ssl);
+                break;
             }
         }
-        else if(request.proto==httpsrequest::protocol::HTTP)
+        if(it->isEmpty()) idle.erase(it);
+    }
+public:
+    inline static qint64 maxidletime=30*1000;
+    inline static int maxidleperhost=4;
+    inline static std::atomic<quint64> hits=0,misses=0,evictions=0;
+    inline static QString key(const QString &owner,const QString &host,quint16 port,bool encrypted)
+    {
+        return QString("%1|%2://%3:%4").arg(owner).arg(encrypted ? "https" : "http").arg(host).arg(port);
+    }
+    inline static QSslSocket* borrow(const QString &key,bool encrypted)
+    {
+        evictExpired();
+        auto it=idle.find(key);
+        while(it!=idle.end() && !it->isEmpty())
         {
-            ssl.connectToHost(request.host,request.port);
-            if(!ssl.waitForConnected())
+            httpsconnection c=it->takeLast();
+            unwatch(c);
+            if(c.ssl->state()==QAbstractSocket::ConnectedState && c.ssl->bytesAvailable()==0 && (!encrypted || c.ssl->isEncrypted()))
             {
-                qDebug() << "httpsclient error:" << ssl.errorString() << "error:" << ssl.error();
-                return connected=false;
+                if(it->isEmpty()) idle.erase(it);
+                hits++;
+                return c.ssl;
             }
+            evictions++;
+            discard(c.ssl);
         }
-        qDebug() << "Connected!";
-        return connected=true;
+        if(it!=idle.end()) idle.erase(it);
+        misses++;
+        return nullptr;
     }
-    bool readyRead()
+    inline static void giveback(const QString &key,QSslSocket *ssl)
     {
-        for(int i=0; i < (waittime); i++)
+        if(ssl==nullptr) return;
+        if(ssl->state()!=QAbstractSocket::ConnectedState)
         {
-            if(ssl.waitForReadyRead(1))
-                return true;
+            discard(ssl);
+            return;
+        }
+        httpsconnection c;
+        c.ssl=ssl;
+        c.lastused=QDateTime::currentMSecsSinceEpoch();
+        c.onreadyread=QObject::connect(ssl,&QSslSocket::readyRead,ssl,[key,ssl]{ drop(key,ssl); });
+        c.ondisconnected=QObject::connect(ssl,&QSslSocket::disconnected,ssl,[key,ssl]{ drop(key,ssl); });
+        auto &connections=idle[key];
+        connections.push_back(c);
+        if(connections.size() > maxidleperhost)
+        {
+            httpsconnection overflow=connections.takeFirst();
+            unwatch(overflow);
+            evictions++;
+            discard(overflow.ssl);
+        }
+    }
+    inline static void evictExpired()
+    {
+        qint64 now=QDateTime::currentMSecsSinceEpoch();
+        for(auto it=idle.begin(); it!=idle.end();)
+        {
+            while(!it->isEmpty() && now-it->first().lastused > maxidletime)
+            {
+                httpsconnection c=it->takeFirst();
+                unwatch(c);
+                evictions++;
+                discard(c.ssl);
+            }
+            if(it->isEmpty())
+                it=idle.erase(it);
+            else
+                ++it;
         }
-        return false;
     }
-    void close()
+    inline static void clear()
     {
-        if(connected)
+        for(auto &connections : idle)
         {
-            ssl.close();
-            connected=false;
+            for(auto &c : connections)
+            {
+                unwatch(c);
+                discard(c.ssl);
+            }
         }
+        idle.clear();
     }
+    inline static QString report()
+    {
+        return QString("httpsconnectionpool hits: %1 misses: %2 evictions: %3").arg(hits).arg(misses).arg(evictions);
+    }
+};
+
+//The dedicated event loop every https exchange runs on, so a few processing threads can keep lots of requests in flight
+class httpsio
+{
+private:
+    inline static QMutex mutex;
+    inline static Thread<QObject> *thread=nullptr;
 public:
-    httpsresponse send(httpsrequest request)
+    inline static QObject* context()
+    {
+        QMutexLocker locker(&mutex);
+        if(thread==nullptr)
+        {
+            thread=new Thread<QObject>(new QObject);
+            thread->setObjectName("httpsio");
+        }
+        return thread->worker;
+    }
+    inline static bool onThread()
+    {
+        QMutexLocker locker(&mutex);
+        return thread!=nullptr && QThread::currentThread()==thread;
+    }
+    inline static void post(std::function<void()> func)
+    {
+        QMetaObject::invokeMethod(context(),func,Qt::QueuedConnection);
+    }
+    inline static void stop()
     {
-        for(int i=0; i < numretries; i++)
+        Thread<QObject> *stopping=nullptr;
         {
-            if(!open(request)) return httpsresponse();
+            QMutexLocker locker(&mutex);
+            std::swap(stopping,thread);
+        }
+        if(stopping==nullptr) return;
+        QMetaObject::invokeMethod(stopping->worker,[]{ httpsconnectionpool::clear(); },Qt::BlockingQueuedConnection);
+        delete stopping;
+    }
+};
 
-            if(!authorization.isEmpty())
-                request.authorization=authorization;
-            if(!useragent.isEmpty())
-                request.userAgent=useragent;
+//Process wide host name -> addresses cache so new connections skip the lookup, shared by every httpsclient of every bot
+//QHostInfo doesn't tell the record's TTL so entries live for a fixed time; only ever touched on the httpsio thread
+class httpsresolved
+{
+public:
+    QList<QHostAddress> addresses;
+    qint64 expires=0;
+};
 
-            if(usecompression)
+class httpsresolver
+{
+private:
+    using waiter=QPair<QPointer<QObject>,std::function<void(QHostAddress)>>;
+    inline static QHash<QString,httpsresolved> cache;
+    inline static QHash<QString,QVector<waiter>> pending; //Concurrent lookups of one host share a single QHostInfo query
+public:
+    inline static qint64 ttl=5*60*1000;
+    inline static std::atomic<quint64> hits=0,misses=0,failures=0,lookupmsecs=0;
+    //Calls back with the address to connect to, a null address means the lookup failed and the socket should resolve by itself
+    inline static void resolve(const QString &host,QObject *receiver,std::function<void(QHostAddress)> callback)
+    {
+        QHostAddress literal;
+        if(literal.setAddress(host))
+        {
+            callback(literal);
+            return;
+        }
+        auto it=cache.find(host);
+        if(it!=cache.end())
+        {
+            if(it->expires > QDateTime::currentMSecsSinceEpoch())
+            {
+                hits++;
+                callback(it->addresses.first());
+                return;
+            }
+            cache.erase(it);
+        }
+        misses++;
+        auto &waiting=pending[host];
+        waiting.push_back(waiter(receiver,callback));
+        if(waiting.size() > 1) return;
+        QElapsedTimer elapsed;
+        elapsed.start();
+        QHostInfo::lookupHost(host,httpsio::context(),[host,elapsed](const QHostInfo &info)
+        {
+            lookupmsecs+=elapsed.elapsed();
+            QHostAddress address;
+            if(info.error()==QHostInfo::NoError && !info.addresses().isEmpty())
             {
-                request.acceptEncoding="gzip, deflate, br";
-                request.generate();
-                request.compress();
+                httpsresolved entry;
+                entry.addresses=info.addresses();
+                entry.expires=QDateTime::currentMSecsSinceEpoch()+ttl;
+                cache.insert(host,entry);
+                address=entry.addresses.first();
             }
             else
             {
-                request.acceptEncoding="identity";
-                request.generate();
+                failures++;
+                qDebug() << "Lookup failed for:" << host << info.errorString();
             }
-
-            ssl.write(request.text);
-            qDebug() << "Request sent! : " << request.text;
-            if(readyRead())
+            for(auto &w : pending.take(host))
             {
-                httpsresponse response;
-                QByteArray buildresponse=ssl.read(readsize);
-                response.setresponse(buildresponse);
-                QByteArray keepalive="!";
-                QCompressor::gzipCompress(keepalive,keepalive);
-                if(response.headers.contains("Transfer-Encoding: chunked"))
-                {
-                    buildresponse.clear();
-                    bool allchunksreceived=false;
-                    int chunkindex=0;
-                    do
-                    {
-                        ssl.write(keepalive);
-                        if(readyRead())
-                        {
-                            int contentsize=response.content.size();
-                            response.content.resize(contentsize+readsize);
-                            qint64 r=ssl.read(response.content.data()+contentsize,readsize);
-                            if(r==0 || r==-1)
-                                allchunksreceived=true;
-                            if(r > 0)
-                                response.content.resize(contentsize+r);
-                            else
-                                response.content.resize(contentsize);
-                        }
+                if(w.first)
+                    w.second(address);
+            }
+        });
+    }
+    //Connecting to address failed, the next attempt moves on to the host's other addresses
+    inline static void forget(const QString &host,const QHostAddress &address)
+    {
+        auto it=cache.find(host);
+        if(it==cache.end()) return;
+        it->addresses.removeAll(address);
+        if(it->addresses.isEmpty())
+            cache.erase(it);
+    }
+    inline static QString report()
+    {
+        quint64 m=misses;
+        return QString("httpsresolver hits: %1 lookups: %2 failures: %3 avg lookup: %4ms")
+                .arg(hits).arg(m).arg(failures).arg(m ? lookupmsecs/m : 0);
+    }
+};
 
-                        QString extractedChunkSize=extract(response.content,"\r\n",chunkindex);
-                        int chunksize=extractedChunkSize.toInt(nullptr,16);
-                        if(chunksize==0)
-                        {
-                            allchunksreceived=true;
-                            break;
-                        }
-                        QByteArray chunk=response.content.mid(chunkindex,chunksize);
-                        if(chunk.size()==chunksize)
-                        {
-                            buildresponse+=chunk;
-                            chunkindex+=chunksize+2;
-                        }
-                    } while(!allchunksreceived);
-                    response.content=buildresponse;
-                }
-                else if(response.headers.contains("Content-Length: "))
-                {
-                    QString extractedContentLen=extract(response.headers,"Content-Length: ","\r\n");
-                    int contentlen=extractedContentLen.toInt();
-                    int writeoffset=response.content.size();
-                    response.content.resize(contentlen);
-                    while(writeoffset < contentlen)
-                    {
-                        ssl.write(keepalive);
-                        if(readyRead())
-                        {
-                            qint64 r=ssl.read(response.content.data()+writeoffset,readsize);
-                            if(r >= 0)
-                                writeoffset+=r;
-                            if(r==0 || r==-1) break;
-                        }
-                        else break;
-                    }
-                }
-                close();
+//Last TLS session per host:port, offered on the next connect so it can be an abbreviated handshake instead of a full one
+//Shared across all bots like the resolver and also only touched on the httpsio thread
+class httpssession
+{
+public:
+    QByteArray ticket;
+    qint64 expires=0;
+};
 
-                if(usecompression && response.decompress())
-                {
-                    qDebug() << "Decompressed successfully! size:" << response.content.size() << "->" << response.content;
-                }
-                else
-                {
-                    qDebug() << "Response size:" << response.content.size() << "->" << response.content;
-                }
+class httpssessioncache
+{
+private:
+    inline static QHash<QString,httpssession> sessions;
+    inline static QString key(const QString &host,quint16 port) { return QString("%1:%2").arg(host).arg(port); }
+public:
+    inline static qint64 maxlifetime=2*60*60*1000;
+    //Handshakes split by whether a cached session was offered. Qt doesn't say whether the server accepted it, so an offered
+    //handshake may still have been a full one, the difference in average time shows how often resumption really happens
+    inline static std::atomic<quint64> offered=0,notoffered=0,offeredmsecs=0,notofferedmsecs=0,stored=0;
+    //Turns session persistence on for the socket and offers the cached session, returns whether there was one to offer
+    inline static bool prepare(QSslSocket *ssl,const QString &host,quint16 port)
+    {
+        QSslConfiguration config=ssl->sslConfiguration();
+        config.setSslOption(QSsl::SslOptionDisableSessionPersistence,false);
+        QByteArray ticket;
+        auto it=sessions.find(key(host,port));
+        if(it!=sessions.end())
+        {
+            if(it->expires > QDateTime::currentMSecsSinceEpoch())
+                ticket=it->ticket;
+            else
+                sessions.erase(it);
+        }
+        config.setSessionTicket(ticket);
+        ssl->setSslConfiguration(config);
+        return !ticket.isEmpty();
+    }
+    //After the handshake and whenever a TLS 1.3 server sends a new ticket
+    inline static void store(QSslSocket *ssl,const QString &host,quint16 port)
+    {
+        QSslConfiguration config=ssl->sslConfiguration();
+        QByteArray ticket=config.sessionTicket();
+        if(ticket.isEmpty()) return;
+        int hint=config.sessionTicketLifeTimeHint();
+        httpssession session;
+        session.ticket=ticket;
+        session.expires=QDateTime::currentMSecsSinceEpoch()+(hint > 0 ? qMin<qint64>(hint*1000LL,maxlifetime) : maxlifetime);
+        sessions.insert(key(host,port),session);
+        stored++;
+    }
+    inline static void forget(const QString &host,quint16 port) { sessions.remove(key(host,port)); }
+    inline static void recordHandshake(bool sessionoffered,qint64 msecs)
+    {
+        if(sessionoffered)
+        {
+            offered++;
+            offeredmsecs+=msecs;
+        }
+        else
+        {
+            notoffered++;
+            notofferedmsecs+=msecs;
+        }
+    }
+    inline static QString report()
+    {
+        quint64 o=offered,n=notoffered;
+        return QString("httpssessioncache handshakes with a session offered: %1 avg: %2ms without: %3 avg: %4ms sessions stored: %5")
+                .arg(o).arg(o ? offeredmsecs/o : 0).arg(n).arg(n ? notofferedmsecs/n : 0).arg(stored);
+    }
+};
+
+using httpscallback=std::function<void(httpsresponse)>;
+
+//One request/response round trip driven entirely by socket signals on the httpsio thread, deletes itself when done
+class httpsexchange : public QObject
+{
+    Q_OBJECT
+private:
+    httpsrequest request;
+    httpscallback callback;
+    QSslSocket *ssl=nullptr;
+    QTimer timer;
+    QElapsedTimer handshake;
+    QString poolkey;
+    QHostAddress address;
+    httpsparser parser;
+    QByteArray readbuffer;
+    bool usecompression=true,encrypted=true,done=false,leftover=false,connecting=false,offeredsession=false;
+    bool responded=false; //Response bytes came in, a request that got none (e.g. a reused connection the server had closed) is safe to retry
+    int waittime=2000,connecttime=30000,retriesleft=3,attempt=0;
+public:
+    inline static int readsize=0x4000;
+    httpsexchange(httpsrequest req,httpscallback func,QString owner,bool compression,int wait,int retries,httpsconsumer consumer=nullptr)
+        : request(req),callback(func),usecompression(compression),waittime(wait),retriesleft(retries)
+    {
+        parser.consumer=consumer;
+        parser.decode=usecompression;
+        readbuffer.resize(readsize);
+        encrypted=(request.proto==httpsrequest::protocol::HTTPS);
+        poolkey=httpsconnectionpool::key(owner,request.host,request.port,encrypted);
+        timer.setSingleShot(true);
+        connect(&timer,&QTimer::timeout,this,&httpsexchange::onTimeout);
+    }
+    void start()
+    {
+        parser.reset();
+        responded=false;
+        leftover=connecting=offeredsession=false;
+        ssl=(request.keepalive ? httpsconnectionpool::borrow(poolkey,encrypted) : nullptr);
+        bool reused=(ssl!=nullptr);
+        if(!reused)
+            ssl=new QSslSocket();
+        connect(ssl,&QSslSocket::readyRead,this,&httpsexchange::onReadyRead);
+        connect(ssl,&QSslSocket::disconnected,this,&httpsexchange::onDisconnected);
+        connect(ssl,&QSslSocket::errorOccurred,this,&httpsexchange::onError);
+        if(reused)
+        {
+            write();
+            return;
+        }
+        handshake.start();
+        timer.start(connecttime);
+        connecting=true;
+        int current=++attempt;
+        httpsresolver::resolve(request.host,this,[this,current](QHostAddress resolved)
+        {
+            if(current==attempt && !done)
+                connectTo(resolved);
+        });
+    }
+private:
+    void connectTo(const QHostAddress &resolved)
+    {
+        address=resolved;
+        QString target=(address.isNull() ? request.host : address.toString());
+        if(encrypted)
+        {
+            offeredsession=httpssessioncache::prepare(ssl,request.host,request.port);
+            connect(ssl,&QSslSocket::encrypted,this,&httpsexchange::onConnected);
+            connect(ssl,&QSslSocket::newSessionTicketReceived,this,&httpsexchange::onSessionTicket);
+            ssl->connectToHostEncrypted(target,request.port,request.host); //Certificate and SNI still go by the host name
+        }
+        else
+        {
+            connect(ssl,&QSslSocket::connected,this,&httpsexchange::onConnected);
+            ssl->connectToHost(target,request.port);
+        }
+    }
+    void onConnected()
+    {
+        connecting=false;
+        if(encrypted)
+        {
+            httpssessioncache::recordHandshake(offeredsession,handshake.elapsed());
+            httpssessioncache::store(ssl,request.host,request.port);
+        }
+        qDebug() << "Connected! handshake:" << handshake.elapsed() << "ms to:" << request.host << address.toString() << (offeredsession ? "session offered" : "no session offered");
+        write();
+    }
+    void onSessionTicket()
+    {
+        httpssessioncache::store(ssl,request.host,request.port);
+    }
+    void write()
+    {
+        ssl->write(request.text);
+        qDebug() << "Request sent! : " << request.text;
+        timer.start(waittime);
+    }
+    void onReadyRead()
+    {
+        timer.start(waittime);
+        qint64 r=0;
+        while(!done && (r=ssl->read(readbuffer.data(),readbuffer.size())) > 0)
+        {
+            responded=true;
+            qint64 used=parser.feed(readbuffer.constData(),r);
+            leftover=(used < r);
+            if(parser.done())
+                complete();
+            else if(parser.failed())
+                fail();
+        }
+    }
+    void onDisconnected()
+    {
+        //Without a length or chunking the body runs until the server closes
+        parser.finish();
+        if(parser.done())
+            complete();
+        else
+            fail();
+    }
+    void onError(QAbstractSocket::SocketError error)
+    {
+        if(error==QAbstractSocket::RemoteHostClosedError) return; //disconnected() takes it from here
+        qDebug() << "httpsclient error:" << ssl->errorString() << "error:" << error;
+        fail();
+    }
+    void onTimeout()
+    {
+        if(parser.untilclose)
+        {
+            parser.finish();
+            complete();
+        }
+        else
+            fail();
+    }
+    void release(bool reusable)
+    {
+        if(ssl==nullptr) return;
+        QObject::disconnect(ssl,nullptr,this,nullptr);
+        if(reusable && request.keepalive)
+            httpsconnectionpool::giveback(poolkey,ssl);
+        else
+        {
+            ssl->abort();
+            ssl->deleteLater();
+        }
+        ssl=nullptr;
+    }
+    void complete()
+    {
+        if(done) return;
+        //Only hand the connection back if exactly this response was read off of it and the server wants it kept
+        release(!parser.untilclose && !leftover && parser.keepAlive());
+        httpsresponse response(parser);
+        if(parser.decoding())
+        {
+            qDebug() << "Decompressed successfully! size:" << parser.encodedSize() << "->" << response.content.size() << "->" << response.content;
+        }
+        else
+        {
+            qDebug() << "Response size:" << response.content.size() << "->" << response.content;
+        }
+        finish(response);
+    }
+    void fail()
+    {
+        if(done) return;
+        if(connecting)
+        {
+            //Never got through, the retry shouldn't pick the same address or offer the same session again
+            if(!address.isNull())
+                httpsresolver::forget(request.host,address);
+            if(offeredsession)
+                httpssessioncache::forget(request.host,request.port);
+            connecting=false;
+        }
+        release(false);
+        if(--retriesleft > 0 && !responded)
+        {
+            start();
+            return;
+        }
+        qDebug() << "Failed receiving response from:" << request.host << "retries left:" << retriesleft;
+        finish(httpsresponse());
+    }
+    void finish(httpsresponse response)
+    {
+        done=true;
+        timer.stop();
+        if(callback) callback(response);
+        deleteLater();
+    }
+};
 
-                return response;
+//Shared response cache under every httpsclient: an in-memory LRU backed by one file per entry on disk
+//GETs with a cached copy go out with If-None-Match/If-Modified-Since and a 304 hands back the stored body
+class httpscacheentry
+{
+public:
+    QByteArray headers,content,etag,lastmodified;
+    QHash<QByteArray,QByteArray> fields;
+    qint64 storedat=0,maxage=-1; //maxage in seconds from Cache-Control, -1 when the server didn't say
+    bool fresh() const { return maxage > 0 && QDateTime::currentMSecsSinceEpoch()-storedat < maxage*1000; }
+    qint64 size() const { return headers.size()+content.size(); }
+    httpsresponse response() const
+    {
+        httpsresponse r(headers,content);
+        r.fields=fields;
+        r.status=200;
+        return r;
+    }
+};
+
+class httpscache
+{
+private:
+    class slot
+    {
+    public:
+        httpscacheentry entry;
+        std::list<QString>::iterator position;
+    };
+    inline static QMutex mutex;
+    inline static QHash<QString,slot> entries;
+    inline static std::list<QString> lru; //Most recently used first
+    inline static qint64 memorybytes=0;
+    inline static QString path;
+    inline static QString fileName(const QString &key)
+    {
+        if(path.isEmpty())
+        {
+            path=(directory.isEmpty() ? QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+"/http" : directory);
+            QDir().mkpath(path);
+        }
+        return path+"/"+QCryptographicHash::hash(key.toUtf8(),QCryptographicHash::Sha1).toHex()+".cache";
+    }
+    inline static void insert(const QString &key,const httpscacheentry &entry)
+    {
+        remove(key);
+        if(entry.size() > maxmemory) return;
+        lru.push_front(key);
+        slot s;
+        s.entry=entry;
+        s.position=lru.begin();
+        entries.insert(key,s);
+        memorybytes+=entry.size();
+        while(memorybytes > maxmemory && !lru.empty())
+        {
+            remove(lru.back());
+            evictions++;
+        }
+    }
+    inline static void remove(const QString &key)
+    {
+        auto it=entries.find(key);
+        if(it==entries.end()) return;
+        memorybytes-=it->entry.size();
+        lru.erase(it->position);
+        entries.erase(it);
+    }
+    inline static bool readFile(const QString &key,httpscacheentry &entry)
+    {
+        QFile file(fileName(key));
+        if(!file.open(QIODevice::ReadOnly)) return false;
+        QDataStream in(&file);
+        QString storedkey;
+        in >> storedkey >> entry.headers >> entry.fields >> entry.etag >> entry.lastmodified >> entry.storedat >> entry.maxage >> entry.content;
+        return in.status()==QDataStream::Ok && storedkey==key;
+    }
+    inline static void writeFile(const QString &key,const httpscacheentry &entry)
+    {
+        QFile file(fileName(key)+".tmp");
+        if(!file.open(QIODevice::WriteOnly)) return;
+        QDataStream out(&file);
+        out << key << entry.headers << entry.fields << entry.etag << entry.lastmodified << entry.storedat << entry.maxage << entry.content;
+        file.close();
+        QFile::remove(fileName(key));
+        file.rename(fileName(key));
+    }
+    //-1: can't be stored, 0: store but always revalidate, otherwise seconds it stays fresh
+    inline static qint64 maxAge(const QByteArray &cachecontrol)
+    {
+        qint64 maxage=-1;
+        for(QByteArray directive : cachecontrol.toLower().split(','))
+        {
+            directive=directive.trimmed();
+            if(directive=="no-store") return -2;
+            if(directive=="no-cache") return 0;
+            if(directive.startsWith("max-age="))
+                maxage=directive.mid(8).toLongLong();
+        }
+        return maxage;
+    }
+public:
+    inline static QString directory; //Empty: the platform cache location
+    inline static qint64 maxmemory=32*1024*1024,maxentrysize=8*1024*1024;
+    inline static bool usedisk=true;
+    inline static std::atomic<quint64> hits=0,revalidated=0,misses=0,stored=0,evictions=0,diskreads=0,bytessaved=0;
+    inline static QString key(const QString &url,const QString &owner) { return owner.isEmpty() ? url : owner+" "+url; }
+    inline static bool lookup(const QString &key,httpscacheentry &entry)
+    {
+        QMutexLocker locker(&mutex);
+        auto it=entries.find(key);
+        if(it!=entries.end())
+        {
+            lru.splice(lru.begin(),lru,it->position);
+            entry=it->entry;
+            return true;
+        }
+        if(usedisk && readFile(key,entry))
+        {
+            diskreads++;
+            insert(key,entry);
+            return true;
+        }
+        misses++;
+        return false;
+    }
+    inline static void addConditions(httpsrequest &request,const httpscacheentry &entry)
+    {
+        if(!entry.etag.isEmpty())
+            request.addCustomHeader("If-None-Match",entry.etag);
+        if(!entry.lastmodified.isEmpty())
+            request.addCustomHeader("If-Modified-Since",entry.lastmodified);
+    }
+    inline static httpsresponse serveFresh(const httpscacheentry &entry)
+    {
+        hits++;
+        bytessaved+=entry.content.size();
+        return entry.response();
+    }
+    //304: the stored body is still good, take over the new freshness information and answer with the cached copy
+    inline static httpsresponse serveRevalidated(const QString &key,httpscacheentry entry,const httpsresponse &notmodified)
+    {
+        revalidated++;
+        bytessaved+=entry.content.size();
+        entry.storedat=QDateTime::currentMSecsSinceEpoch();
+        QByteArray cachecontrol=notmodified.header("cache-control");
+        if(!cachecontrol.isEmpty())
+            entry.maxage=qMax<qint64>(-1,maxAge(cachecontrol));
+        QMutexLocker locker(&mutex);
+        insert(key,entry);
+        if(usedisk) writeFile(key,entry);
+        return entry.response();
+    }
+    inline static void store(const QString &key,const httpsresponse &response)
+    {
+        if(response.status!=200 || response.content.size() > maxentrysize) return;
+        httpscacheentry entry;
+        entry.maxage=maxAge(response.header("cache-control"));
+        entry.etag=response.header("etag");
+        entry.lastmodified=response.header("last-modified");
+        if(entry.maxage < -1 || (entry.etag.isEmpty() && entry.lastmodified.isEmpty() && entry.maxage <= 0)) return;
+        entry.headers=response.headers;
+        entry.fields=response.fields;
+        entry.content=response.content;
+        entry.storedat=QDateTime::currentMSecsSinceEpoch();
+        QMutexLocker locker(&mutex);
+        insert(key,entry);
+        if(usedisk) writeFile(key,entry);
+        stored++;
+    }
+    inline static QString report()
+    {
+        QMutexLocker locker(&mutex);
+        return QString("httpscache fresh hits: %1 revalidated (304): %2 misses: %3 stored: %4 evictions: %5 disk reads: %6 bytes saved: %7 memory: %8/%9 bytes in %10 entries")
+                .arg(hits).arg(revalidated).arg(misses).arg(stored).arg(evictions).arg(diskreads).arg(bytessaved)
+                .arg(memorybytes).arg(maxmemory).arg(entries.size());
+    }
+};
+
+class httpsclient : public QObject
+{
+    Q_OBJECT
+private:
+    bool usecompression=true,usecache=true;
+    int waittime=2000,numretries=3;
+    QString authorization,useragent;
+    httpsconsumer contentconsumer;
+    void prepare(httpsrequest &request)
+    {
+        if(!authorization.isEmpty())
+            request.authorization=authorization;
+        if(!useragent.isEmpty())
+            request.userAgent=useragent;
+
+        if(usecompression)
+        {
+            request.acceptEncoding=QCompressorStream::acceptEncoding();
+            request.generate();
+            request.compress();
+        }
+        else
+        {
+            request.acceptEncoding="identity";
+            request.generate();
+        }
+    }
+public:
+    //Callback is invoked on the httpsio thread, hand anything slow off from there
+    void sendAsync(httpsrequest request,httpscallback callback)
+    {
+        if(usecache && request.type==httpsrequest::type::GET && !contentconsumer)
+        {
+            QString key=httpscache::key(request.url,authorization);
+            httpscacheentry cached;
+            bool found=httpscache::lookup(key,cached);
+            if(found && cached.fresh())
+            {
+                httpsio::post([callback,cached]{ httpsresponse response=httpscache::serveFresh(cached); if(callback) callback(response); });
+                return;
             }
-            close();
+            if(found)
+                httpscache::addConditions(request,cached);
+            callback=[key,found,cached,callback](httpsresponse response)
+            {
+                if(found && response.status==304)
+                    response=httpscache::serveRevalidated(key,cached,response);
+                else
+                    httpscache::store(key,response);
+                if(callback) callback(response);
+            };
         }
-        qDebug() << "Failed receiving response after" << numretries << "retries...";
-        close();
-        return httpsresponse();
+        prepare(request);
+        QString owner=authorization;
+        bool compression=usecompression;
+        int wait=waittime,retries=numretries;
+        httpsconsumer consumer=contentconsumer;
+        httpsio::post([=]
+        {
+            auto exchange=new httpsexchange(request,callback,owner,compression,wait,retries,consumer);
+            exchange->start();
+        });
+    }
+    //Blocking wrapper over sendAsync for callers that want the response inline
+    httpsresponse send(httpsrequest request)
+    {
+        if(httpsio::onThread())
+        {
+            httpsresponse response;
+            QEventLoop loop;
+            sendAsync(request,[&](httpsresponse r){ response=r; loop.quit(); });
+            loop.exec();
+            return response;
+        }
+        auto promise=std::make_shared<std::promise<httpsresponse>>();
+        auto future=promise->get_future();
+        sendAsync(request,[promise](httpsresponse r){ promise->set_value(r); });
+        return future.get();
     }
     void setUseCompression(bool shouldusecompression=true)
     {
         usecompression=shouldusecompression;
     }
+    void setUseCache(bool shouldusecache=true)
+    {
+        usecache=shouldusecache;
+    }
+    //Body bytes go straight to consumer (on the httpsio thread) as they arrive instead of into response.content
+    void setContentConsumer(httpsconsumer consumer)
+    {
+        contentconsumer=consumer;
+    }
     void setAuthorization(QString auth)
     {
         authorization=auth;
@@ -416,6 +1332,16 @@ public:
     {
         useragent=userAgent;
     }
+    //Extra certificates (PEM) every https and wss connection in the process trusts, e.g. a local mock server's self-signed one
+    inline static bool trustCertificates(const QString &path)
+    {
+        QList<QSslCertificate> certificates=QSslCertificate::fromPath(path,QSsl::Pem);
+        if(certificates.isEmpty()) return false;
+        QSslConfiguration config=QSslConfiguration::defaultConfiguration();
+        config.addCaCertificates(certificates);
+        QSslConfiguration::setDefaultConfiguration(config);
+        return true;
+    }
     inline static QByteArray extract(const QByteArray &from,const char *upto,int &startingpos)
     {
         if(startingpos != -1)
@@ -11,6 +11,7 @@ int main(int argc,char *argv[])
     discordbotui::botui=make<discordbotui>();
     qRegisterMetaType<QAbstractSocket::SocketState>("QAbstractSocket::SocketState");
     qRegisterMetaType<QAbstractSocket::SocketError>("QAbstractSocket::SocketError");
+    qRegisterMetaType<nlohmann::json>("nlohmann::json");
     discordbotui::botui->show();
     int retval=a->exec();
     discordbotui::botui.reset();
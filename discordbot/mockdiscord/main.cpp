@@ -0,0 +1,80 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFileInfo>
+#include "mockdiscord.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("mockdiscord");
+
+    mockoptions options;
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Local stand-in for the discord REST api and gateway");
+    parser.addHelpOption();
+    QList<QCommandLineOption> list={
+        {"host","Host name clients use, goes into the certificate and gateway url.","name",options.host},
+        {"rest-port","REST (https) port.","port",QString::number(options.restport)},
+        {"gateway-port","Gateway (wss) port.","port",QString::number(options.gatewayport)},
+        {"cert","PEM certificate to use instead of generating one.","file"},
+        {"key","PEM private key for --cert.","file"},
+        {"write-cert","Where the certificate is written for clients to trust.","file",options.writecert},
+        {"heartbeat","Heartbeat interval sent in hello.","ms",QString::number(options.heartbeatinterval)},
+        {"latency","Delay added to every REST response.","ms","0"},
+        {"jitter","Random extra REST delay up to this.","ms","0"},
+        {"bucket-limit","Messages per channel per bucket window before 429.","n",QString::number(options.bucketlimit)},
+        {"bucket-window","Bucket window.","ms",QString::number(options.bucketwindow)},
+        {"ratelimit-rate","Chance of an extra 429 on any message post.","0..1","0"},
+        {"disconnect-every","Drop all gateway connections this often.","seconds","0"},
+        {"invalid-session-rate","Chance a resume is refused with op 9.","0..1","0"},
+        {"guilds","Guilds sent after READY.","n",QString::number(options.guilds)},
+        {"members","Members (and presences) per GUILD_CREATE.","n",QString::number(options.members)},
+        {"messages","MESSAGE_CREATE dispatches per second to every session.","n","0"},
+        {"content","Message content, %1 is the message number.","text",options.content},
+    };
+    parser.addOptions(list);
+    parser.process(a);
+    options.host=parser.value("host");
+    options.restport=parser.value("rest-port").toUShort();
+    options.gatewayport=parser.value("gateway-port").toUShort();
+    options.writecert=parser.value("write-cert");
+    options.heartbeatinterval=parser.value("heartbeat").toInt();
+    options.latency=parser.value("latency").toInt();
+    options.jitter=parser.value("jitter").toInt();
+    options.bucketlimit=parser.value("bucket-limit").toInt();
+    options.bucketwindow=parser.value("bucket-window").toInt();
+    options.ratelimitrate=parser.value("ratelimit-rate").toDouble();
+    options.disconnectevery=parser.value("disconnect-every").toInt();
+    options.invalidsessionrate=parser.value("invalid-session-rate").toDouble();
+    options.guilds=parser.value("guilds").toInt();
+    options.members=parser.value("members").toInt();
+    options.messagespersecond=parser.value("messages").toInt();
+    options.content=parser.value("content");
+
+    mockcertificate certificate;
+    bool ready=(parser.isSet("cert") ? certificate.load(parser.value("cert"),parser.value("key")) : certificate.generate(options.host));
+    if(!ready)
+    {
+        qCritical() << "No usable certificate/key";
+        return 1;
+    }
+    QFile pem(options.writecert);
+    if(pem.open(QIODevice::WriteOnly))
+        pem.write(certificate.certificate.toPem());
+
+    mockrestserver rest(options,certificate);
+    mockgateway gateway(options,certificate);
+    if(!rest.start() || !gateway.start())
+    {
+        qCritical() << "Could not listen on ports" << options.restport << options.gatewayport;
+        return 1;
+    }
+    qInfo().noquote() << QString("mockdiscord listening, point a bot at it with bot_config.json entries:\n"
+                                 "  \"api_base\":\"https://%1:%2\",\"gateway\":\"wss://%1:%3\",\"trusted_cert\":\"%4\"")
+                         .arg(options.host).arg(options.restport).arg(options.gatewayport).arg(QFileInfo(pem).absoluteFilePath());
+
+    QTimer stats;
+    QObject::connect(&stats,&QTimer::timeout,[]{ qInfo().noquote() << mockstats::report(); });
+    stats.start(10*1000);
+    return a.exec();
+}
@@ -0,0 +1,457 @@
+#ifndef MOCKDISCORD_H
+#define MOCKDISCORD_H
+
+#include <QDebug>
+#include <QTcpServer>
+#include <QSslSocket>
+#include <QSslKey>
+#include <QSslCertificate>
+#include <QSslConfiguration>
+#include <QWebSocketServer>
+#include <QWebSocket>
+#include <QHostAddress>
+#include <QRegularExpression>
+#include <QRandomGenerator>
+#include <QDateTime>
+#include <QPointer>
+#include <QTimer>
+#include <QFile>
+#include <QHash>
+#include <deque>
+#include <atomic>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include "../json.hpp"
+using json=nlohmann::json;
+
+//Stand-in for discord's REST api and gateway so the bot can be driven end to end without the real thing
+//Everything runs on the main event loop, faults (latency, 429s, disconnects, refused resumes) are injected from mockoptions
+class mockoptions
+{
+public:
+    QString host="localhost",certpath,keypath,writecert="mockdiscord-cert.pem";
+    quint16 restport=8443,gatewayport=8444;
+    int heartbeatinterval=41250;
+    int latency=0,jitter=0; //Milliseconds added to every REST response
+    int bucketlimit=5,bucketwindow=5000; //Per channel message bucket, going over it answers 429
+    double ratelimitrate=0; //Chance of a 429 on any REST call regardless of the bucket
+    int disconnectevery=0; //Seconds between dropping every gateway connection
+    double invalidsessionrate=0; //Chance a resume is refused with op 9
+    int guilds=1,members=100;
+    int messagespersecond=0;
+    QString content="hello from mockdiscord %1";
+    int backlog=1000; //Dispatches kept per session for resume replay
+};
+
+class mockcertificate
+{
+public:
+    QSslCertificate certificate;
+    QSslKey key;
+    bool load(const QString &certpath,const QString &keypath)
+    {
+        QFile c(certpath),k(keypath);
+        if(!c.open(QIODevice::ReadOnly) || !k.open(QIODevice::ReadOnly)) return false;
+        certificate=QSslCertificate(c.readAll(),QSsl::Pem);
+        key=QSslKey(k.readAll(),QSsl::Rsa,QSsl::Pem);
+        return !certificate.isNull() && !key.isNull();
+    }
+    //Self-signed RSA certificate for host, valid for a year, with host as CN and subjectAltName
+    bool generate(const QString &host)
+    {
+        EVP_PKEY *pkey=nullptr;
+        EVP_PKEY_CTX *ctx=EVP_PKEY_CTX_new_id(EVP_PKEY_RSA,nullptr);
+        bool generated=(ctx && EVP_PKEY_keygen_init(ctx) > 0 && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx,2048) > 0 && EVP_PKEY_keygen(ctx,&pkey) > 0);
+        EVP_PKEY_CTX_free(ctx);
+        if(!generated) return false;
+        X509 *x509=X509_new();
+        X509_set_version(x509,2);
+        ASN1_INTEGER_set(X509_get_serialNumber(x509),(long)QRandomGenerator::global()->bounded(1,0x7fffffff));
+        X509_gmtime_adj(X509_getm_notBefore(x509),-3600);
+        X509_gmtime_adj(X509_getm_notAfter(x509),365L*24*3600);
+        X509_set_pubkey(x509,pkey);
+        QByteArray cn=host.toUtf8();
+        X509_NAME *name=X509_get_subject_name(x509);
+        X509_NAME_add_entry_by_txt(name,"CN",MBSTRING_ASC,(const unsigned char*)cn.constData(),-1,-1,0);
+        X509_set_issuer_name(x509,name);
+        X509V3_CTX v3;
+        X509V3_set_ctx_nodb(&v3);
+        X509V3_set_ctx(&v3,x509,x509,nullptr,nullptr,0);
+        QByteArray san=(QHostAddress(host).isNull() ? "DNS:" : "IP:")+cn;
+        if(X509_EXTENSION *ext=X509V3_EXT_conf_nid(nullptr,&v3,NID_subject_alt_name,san.data()))
+        {
+            X509_add_ext(x509,ext,-1);
+            X509_EXTENSION_free(ext);
+        }
+        X509_sign(x509,pkey,EVP_sha256());
+        certificate=QSslCertificate(toPem([x509](BIO *bio){ return PEM_write_bio_X509(bio,x509); }),QSsl::Pem);
+        key=QSslKey(toPem([pkey](BIO *bio){ return PEM_write_bio_PrivateKey(bio,pkey,nullptr,nullptr,0,nullptr,nullptr); }),QSsl::Rsa,QSsl::Pem);
+        X509_free(x509);
+        EVP_PKEY_free(pkey);
+        return !certificate.isNull() && !key.isNull();
+    }
+    QSslConfiguration serverConfiguration() const
+    {
+        QSslConfiguration config=QSslConfiguration::defaultConfiguration();
+        config.setLocalCertificate(certificate);
+        config.setPrivateKey(key);
+        config.setPeerVerifyMode(QSslSocket::VerifyNone);
+        return config;
+    }
+private:
+    template<class TWrite> inline static QByteArray toPem(TWrite write)
+    {
+        BIO *bio=BIO_new(BIO_s_mem());
+        QByteArray pem;
+        if(write(bio))
+        {
+            char *data=nullptr;
+            long size=BIO_get_mem_data(bio,&data);
+            pem=QByteArray(data,(int)size);
+        }
+        BIO_free(bio);
+        return pem;
+    }
+};
+
+class mockstats
+{
+public:
+    inline static std::atomic<quint64> restrequests=0,messagesposted=0,limited=0,notfound=0;
+    inline static std::atomic<quint64> connections=0,identifies=0,resumes=0,refusedresumes=0,heartbeats=0,dispatched=0,disconnects=0;
+    inline static QString report()
+    {
+        return QString("rest requests: %1 messages posted: %2 429s: %3 404s: %4 | gateway connections: %5 identifies: %6 resumes: %7 refused resumes: %8 heartbeats: %9 dispatched: %10 injected disconnects: %11")
+                .arg(restrequests).arg(messagesposted).arg(limited).arg(notfound).arg(connections).arg(identifies)
+                .arg(resumes).arg(refusedresumes).arg(heartbeats).arg(dispatched).arg(disconnects);
+    }
+};
+
+class mockids
+{
+public:
+    inline static quint64 next=QDateTime::currentMSecsSinceEpoch() << 22;
+    inline static QString snowflake() { return QString::number(++next); }
+    inline static QString botid() { return "100000000000000001"; }
+    inline static QString guildid(int guild) { return QString::number(200000000000000000ull+guild); }
+    inline static QString channelid(int guild) { return QString::number(300000000000000000ull+guild); }
+    inline static QString userid(int member) { return QString::number(400000000000000000ull+member); }
+};
+
+class mockbucket
+{
+public:
+    int remaining=0;
+    qint64 resetat=0;
+};
+
+//Just enough HTTP/1.1 over TLS for the routes the bot uses, keep-alive included
+class mockrestserver : public QTcpServer
+{
+    Q_OBJECT
+private:
+    mockoptions &options;
+    const mockcertificate &certificate;
+    QHash<QString,mockbucket> buckets;
+public:
+    mockrestserver(mockoptions &opts,const mockcertificate &cert,QObject *parent=nullptr) : QTcpServer(parent),options(opts),certificate(cert) { }
+    bool start() { return listen(QHostAddress::Any,options.restport); }
+protected:
+    void incomingConnection(qintptr descriptor) override
+    {
+        auto ssl=new QSslSocket(this);
+        if(!ssl->setSocketDescriptor(descriptor))
+        {
+            delete ssl;
+            return;
+        }
+        ssl->setSslConfiguration(certificate.serverConfiguration());
+        auto buffer=std::make_shared<QByteArray>();
+        connect(ssl,&QSslSocket::readyRead,this,[this,ssl,buffer]{ onReadyRead(ssl,*buffer); });
+        connect(ssl,&QSslSocket::disconnected,ssl,&QObject::deleteLater);
+        ssl->startServerEncryption();
+    }
+private:
+    void onReadyRead(QSslSocket *ssl,QByteArray &buffer)
+    {
+        buffer+=ssl->readAll();
+        for(;;)
+        {
+            int headersend=buffer.indexOf("\r\n\r\n");
+            if(headersend==-1) return;
+            QList<QByteArray> lines=buffer.left(headersend).split('\n');
+            QList<QByteArray> requestline=lines.takeFirst().trimmed().split(' ');
+            QHash<QByteArray,QByteArray> headers;
+            for(auto &line : lines)
+            {
+                int colon=line.indexOf(':');
+                if(colon > 0)
+                    headers.insert(line.left(colon).trimmed().toLower(),line.mid(colon+1).trimmed());
+            }
+            int length=headers.value("content-length").toInt();
+            if(buffer.size() < headersend+4+length) return;
+            QByteArray body=buffer.mid(headersend+4,length);
+            buffer.remove(0,headersend+4+length);
+            if(requestline.size() < 2)
+            {
+                ssl->disconnectFromHost();
+                return;
+            }
+            handle(ssl,requestline.at(0),requestline.at(1),headers,body);
+        }
+    }
+    void handle(QSslSocket *ssl,const QByteArray &method,const QByteArray &target,const QHash<QByteArray,QByteArray> &headers,const QByteArray &body)
+    {
+        mockstats::restrequests++;
+        QString path=QString(target).section('?',0,0);
+        bool close=headers.value("connection").toLower()=="close";
+        static const QRegularExpression gatewayroute("^/api(/v\\d+)?/gateway(/bot)?$");
+        static const QRegularExpression messagesroute("^/api(/v\\d+)?/channels/(\\d+)/messages$");
+        static const QRegularExpression typingroute("^/api(/v\\d+)?/channels/(\\d+)/typing$");
+        QRegularExpressionMatch match;
+        if(gatewayroute.match(path).hasMatch())
+        {
+            respond(ssl,200,QString(R"({"url":"wss://%1:%2","shards":1,"session_start_limit":{"total":1000,"remaining":999,"reset_after":86400000,"max_concurrency":1}})")
+                    .arg(options.host).arg(options.gatewayport).toUtf8(),{},close);
+        }
+        else if(method=="POST" && (match=messagesroute.match(path)).hasMatch())
+        {
+            QString channel=match.captured(2);
+            QList<QPair<QByteArray,QByteArray>> ratelimit;
+            if(limit(channel,ratelimit))
+            {
+                respond(ssl,429,R"({"message":"You are being rate limited.","retry_after":)"+ratelimit.last().second+R"(,"global":false})",ratelimit,close);
+                return;
+            }
+            json posted=json::parse(body.constData(),body.constData()+body.size(),nullptr,false);
+            std::string content=(posted.is_object() && posted["content"].is_string() ? posted["content"].get<std::string>() : std::string());
+            json message={{"id",mockids::snowflake().toStdString()},{"channel_id",channel.toStdString()},{"content",content},
+                          {"author",{{"id",mockids::botid().toStdString()},{"username","mockbot"},{"discriminator","0001"},{"avatar",nullptr},{"bot",true}}},
+                          {"timestamp",QDateTime::currentDateTimeUtc().toString(Qt::ISODateWithMs).toStdString()},{"type",0}};
+            mockstats::messagesposted++;
+            respond(ssl,200,QByteArray::fromStdString(message.dump()),ratelimit,close);
+        }
+        else if(method=="POST" && typingroute.match(path).hasMatch())
+            respond(ssl,204,QByteArray(),{},close);
+        else
+        {
+            mockstats::notfound++;
+            respond(ssl,404,R"({"message":"404: Not Found","code":0})",{},close);
+        }
+    }
+    //Fills in the x-ratelimit headers for the channel's bucket, true when this request has to be answered with 429
+    bool limit(const QString &channel,QList<QPair<QByteArray,QByteArray>> &headers)
+    {
+        qint64 now=QDateTime::currentMSecsSinceEpoch();
+        mockbucket &bucket=buckets[channel];
+        if(now >= bucket.resetat)
+        {
+            bucket.remaining=options.bucketlimit;
+            bucket.resetat=now+options.bucketwindow;
+        }
+        bool injected=(options.ratelimitrate > 0 && QRandomGenerator::global()->generateDouble() < options.ratelimitrate);
+        bool limited=(injected || bucket.remaining <= 0);
+        if(!limited)
+            bucket.remaining--;
+        QByteArray resetafter=QByteArray::number((bucket.resetat-now)/1000.0,'f',3);
+        headers={{"X-RateLimit-Bucket","mock-"+channel.toUtf8()},{"X-RateLimit-Limit",QByteArray::number(options.bucketlimit)},
+                 {"X-RateLimit-Remaining",QByteArray::number(bucket.remaining)},{"X-RateLimit-Reset-After",resetafter}};
+        if(limited)
+        {
+            mockstats::limited++;
+            headers.append({"Retry-After",injected ? QByteArray("0.250") : resetafter});
+        }
+        return limited;
+    }
+    void respond(QSslSocket *ssl,int status,const QByteArray &body,const QList<QPair<QByteArray,QByteArray>> &extra,bool close)
+    {
+        static const QHash<int,QByteArray> reasons={{200,"OK"},{204,"No Content"},{404,"Not Found"},{429,"Too Many Requests"}};
+        QByteArray response="HTTP/1.1 "+QByteArray::number(status)+" "+reasons.value(status)+"\r\n";
+        response+="Content-Type: application/json\r\n";
+        for(auto &header : extra)
+            response+=header.first+": "+header.second+"\r\n";
+        if(status!=204)
+            response+="Content-Length: "+QByteArray::number(body.size())+"\r\n";
+        response+=(close ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n");
+        if(status!=204)
+            response+=body;
+        int delay=options.latency+(options.jitter > 0 ? QRandomGenerator::global()->bounded(options.jitter) : 0);
+        QPointer<QSslSocket> socket=ssl;
+        auto send=[socket,response,close]
+        {
+            if(!socket) return;
+            socket->write(response);
+            if(close) socket->disconnectFromHost();
+        };
+        if(delay > 0)
+            QTimer::singleShot(delay,ssl,send);
+        else
+            send();
+    }
+};
+
+class mocksession
+{
+public:
+    QString id;
+    quint64 sequence=0;
+    std::deque<QPair<quint64,QString>> backlog;
+};
+
+//Gateway over wss: hello, identify -> READY + GUILD_CREATE, heartbeat ack, resume with replay, invalid session, MESSAGE_CREATE load
+class mockgateway : public QObject
+{
+    Q_OBJECT
+private:
+    mockoptions &options;
+    QWebSocketServer server;
+    QHash<QWebSocket*,QString> sessionof;
+    QHash<QString,mocksession> sessions;
+    QTimer messagetimer,disconnecttimer;
+    double owedmessages=0;
+    quint64 messagecount=0;
+public:
+    mockgateway(mockoptions &opts,const mockcertificate &certificate,QObject *parent=nullptr)
+        : QObject(parent),options(opts),server("mockdiscord",QWebSocketServer::SecureMode)
+    {
+        server.setSslConfiguration(certificate.serverConfiguration());
+        connect(&server,&QWebSocketServer::newConnection,this,&mockgateway::onNewConnection);
+        connect(&messagetimer,&QTimer::timeout,this,&mockgateway::onMessageTick);
+        connect(&disconnecttimer,&QTimer::timeout,this,&mockgateway::onDisconnectTick);
+    }
+    bool start()
+    {
+        if(!server.listen(QHostAddress::Any,options.gatewayport)) return false;
+        if(options.messagespersecond > 0)
+            messagetimer.start(10);
+        if(options.disconnectevery > 0)
+            disconnecttimer.start(options.disconnectevery*1000);
+        return true;
+    }
+private:
+    void onNewConnection()
+    {
+        while(server.hasPendingConnections())
+        {
+            QWebSocket *ws=server.nextPendingConnection();
+            mockstats::connections++;
+            connect(ws,&QWebSocket::textMessageReceived,this,[this,ws](const QString &message){ onTextMessage(ws,message); });
+            connect(ws,&QWebSocket::disconnected,this,[this,ws]
+            {
+                sessionof.remove(ws);
+                ws->deleteLater();
+            });
+            ws->sendTextMessage(QString(R"({"op":10,"d":{"heartbeat_interval":%1},"s":null,"t":null})").arg(options.heartbeatinterval));
+        }
+    }
+    void onTextMessage(QWebSocket *ws,const QString &message)
+    {
+        json msg=json::parse(message.toStdString(),nullptr,false);
+        if(!msg.is_object() || !msg["op"].is_number()) return;
+        int op=msg["op"].get<int>();
+        if(op==1) //Heartbeat
+        {
+            mockstats::heartbeats++;
+            ws->sendTextMessage(R"({"op":11,"d":null,"s":null,"t":null})");
+        }
+        else if(op==2) //Identify
+        {
+            mockstats::identifies++;
+            mocksession session;
+            session.id=QString::number(QRandomGenerator::global()->generate64(),16);
+            sessions.insert(session.id,session);
+            sessionof.insert(ws,session.id);
+            dispatch(ws,"READY",QString(R"({"v":7,"session_id":"%1","user":{"id":"%2","username":"mockbot","discriminator":"0001","avatar":null,"bot":true},"guilds":[%3],"resume_gateway_url":"wss://%4:%5"})")
+                     .arg(session.id).arg(mockids::botid()).arg(unavailableGuilds()).arg(options.host).arg(options.gatewayport));
+            for(int guild=0; guild < options.guilds; guild++)
+                dispatch(ws,"GUILD_CREATE",guildCreate(guild));
+        }
+        else if(op==6) //Resume
+        {
+            QString id=QString::fromStdString(msg["d"]["session_id"].is_string() ? msg["d"]["session_id"].get<std::string>() : std::string());
+            quint64 seq=(msg["d"]["seq"].is_number() ? msg["d"]["seq"].get<quint64>() : 0);
+            bool refused=(options.invalidsessionrate > 0 && QRandomGenerator::global()->generateDouble() < options.invalidsessionrate);
+            auto it=sessions.find(id);
+            if(it==sessions.end() || refused || (!it->backlog.empty() && it->backlog.front().first > seq+1))
+            {
+                mockstats::refusedresumes++;
+                ws->sendTextMessage(R"({"op":9,"d":false,"s":null,"t":null})");
+                return;
+            }
+            mockstats::resumes++;
+            sessionof.insert(ws,id);
+            for(auto &missed : it->backlog)
+            {
+                if(missed.first > seq)
+                    ws->sendTextMessage(missed.second);
+            }
+            dispatch(ws,"RESUMED","{}");
+        }
+    }
+    void dispatch(QWebSocket *ws,const QString &t,const QString &d)
+    {
+        auto it=sessions.find(sessionof.value(ws));
+        if(it==sessions.end()) return;
+        mocksession &session=it.value();
+        QString message=QString(R"({"op":0,"t":"%1","s":%2,"d":%3})").arg(t).arg(++session.sequence).arg(d);
+        session.backlog.push_back({session.sequence,message});
+        while((int)session.backlog.size() > options.backlog)
+            session.backlog.pop_front();
+        mockstats::dispatched++;
+        ws->sendTextMessage(message);
+    }
+    QString unavailableGuilds()
+    {
+        QStringList guilds;
+        for(int guild=0; guild < options.guilds; guild++)
+            guilds+=QString(R"({"id":"%1","unavailable":true})").arg(mockids::guildid(guild));
+        return guilds.join(',');
+    }
+    QString guildCreate(int guild)
+    {
+        QStringList members,presences;
+        for(int member=0; member < options.members; member++)
+        {
+            QString user=QString(R"({"id":"%1","username":"mockuser%2","discriminator":"%3","avatar":null})")
+                    .arg(mockids::userid(member)).arg(member).arg(member%10000,4,10,QChar('0'));
+            members+=QString(R"({"user":%1,"roles":[],"joined_at":"2020-01-01T00:00:00.000000+00:00","deaf":false,"mute":false})").arg(user);
+            presences+=QString(R"({"user":{"id":"%1"},"status":"%2","activities":[],"client_status":{"desktop":"online"}})")
+                    .arg(mockids::userid(member)).arg(member%3 ? "online" : "idle");
+        }
+        return QString(R"({"id":"%1","name":"mockguild%2","member_count":%3,"channels":[{"id":"%4","type":0,"name":"general"}],"members":[%5],"presences":[%6]})")
+                .arg(mockids::guildid(guild)).arg(guild).arg(options.members).arg(mockids::channelid(guild)).arg(members.join(',')).arg(presences.join(','));
+    }
+    void onMessageTick()
+    {
+        owedmessages+=options.messagespersecond/100.0;
+        while(owedmessages >= 1)
+        {
+            owedmessages--;
+            int guild=(int)(messagecount%qMax(1,options.guilds));
+            int member=(int)(messagecount%qMax(1,options.members));
+            QString content=options.content.arg(++messagecount);
+            //Built as json, the user supplied content can hold anything, %N included
+            json author={{"id",mockids::userid(member).toStdString()},{"username",QString("mockuser%1").arg(member).toStdString()},
+                         {"discriminator",QString("%1").arg(member%10000,4,10,QChar('0')).toStdString()},{"avatar",nullptr}};
+            json message={{"id",mockids::snowflake().toStdString()},{"channel_id",mockids::channelid(guild).toStdString()},
+                          {"guild_id",mockids::guildid(guild).toStdString()},{"author",author},{"content",content.toStdString()},
+                          {"timestamp",QDateTime::currentDateTimeUtc().toString(Qt::ISODateWithMs).toStdString()},{"tts",false},
+                          {"mention_everyone",false},{"mentions",json::array()},{"attachments",json::array()},{"embeds",json::array()},{"type",0}};
+            QString d=QString::fromStdString(message.dump());
+            for(QWebSocket *ws : sessionof.keys())
+                dispatch(ws,"MESSAGE_CREATE",d);
+        }
+    }
+    void onDisconnectTick()
+    {
+        for(QWebSocket *ws : sessionof.keys())
+        {
+            mockstats::disconnects++;
+            ws->abort(); //Like a dropped network, the session stays resumable
+        }
+    }
+};
+
+#endif // MOCKDISCORD_H
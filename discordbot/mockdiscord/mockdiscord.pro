@@ -0,0 +1,20 @@
+QT       += core network websockets
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+CONFIG += link_pkgconfig
+PKGCONFIG += openssl
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+SOURCES += \
+    main.cpp
+
+HEADERS += \
+    mockdiscord.h
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
@@ -0,0 +1,210 @@
+#ifndef MPMCQUEUE_H
+#define MPMCQUEUE_H
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <atomic>
+#include <memory>
+
+//Bounded multi-producer/multi-consumer ring (Dmitry Vyukov's design): pushes and pops are a single CAS on their own
+//cursor, no lock, each cell's sequence number says whether it is ready to be written or read.
+//Consumers that find it empty can block in pop() instead of polling, producers only touch the wait condition
+//when somebody is actually asleep
+template<class T> class mpmcqueue
+{
+private:
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    std::unique_ptr<cell[]> buffer;
+    const size_t mask;
+    alignas(64) std::atomic<size_t> enqueuepos{0};
+    alignas(64) std::atomic<size_t> dequeuepos{0};
+    alignas(64) std::atomic<int> sleepers{0};
+    QMutex waitmutex;
+    QWaitCondition notempty;
+    inline static size_t roundUp(size_t capacity)
+    {
+        size_t size=2;
+        while(size < capacity) size<<=1;
+        return size;
+    }
+public:
+    explicit mpmcqueue(size_t capacity) : buffer(new cell[roundUp(capacity)]),mask(roundUp(capacity)-1)
+    {
+        for(size_t i=0; i <= mask; i++)
+            buffer[i].sequence.store(i,std::memory_order_relaxed);
+    }
+    mpmcqueue(const mpmcqueue&)=delete;
+    void operator=(const mpmcqueue&)=delete;
+    size_t capacity() const { return mask+1; }
+    //Approximate while other threads are pushing/popping
+    size_t size() const
+    {
+        size_t in=enqueuepos.load(std::memory_order_relaxed),out=dequeuepos.load(std::memory_order_relaxed);
+        return in > out ? in-out : 0;
+    }
+    bool empty() const { return size()==0; }
+    //False when full, the value is left untouched then
+    bool tryPush(T &&value)
+    {
+        size_t pos=enqueuepos.load(std::memory_order_relaxed);
+        cell *c;
+        for(;;)
+        {
+            c=&buffer[pos&mask];
+            size_t sequence=c->sequence.load(std::memory_order_acquire);
+            intptr_t diff=(intptr_t)sequence-(intptr_t)pos;
+            if(diff==0)
+            {
+                if(enqueuepos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+                    break;
+            }
+            else if(diff < 0)
+                return false;
+            else
+                pos=enqueuepos.load(std::memory_order_relaxed);
+        }
+        c->value=std::move(value);
+        c->sequence.store(pos+1,std::memory_order_release);
+        //Pairs with the sleeper count going up in pop() before its last look, so a wake up can't slip between them
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(sleepers.load(std::memory_order_relaxed) > 0)
+        {
+            QMutexLocker locker(&waitmutex);
+            notempty.wakeOne();
+        }
+        return true;
+    }
+    bool tryPush(const T &value)
+    {
+        T copy(value);
+        return tryPush(std::move(copy));
+    }
+    bool tryPop(T &value)
+    {
+        size_t pos=dequeuepos.load(std::memory_order_relaxed);
+        cell *c;
+        for(;;)
+        {
+            c=&buffer[pos&mask];
+            size_t sequence=c->sequence.load(std::memory_order_acquire);
+            intptr_t diff=(intptr_t)sequence-(intptr_t)(pos+1);
+            if(diff==0)
+            {
+                if(dequeuepos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+                    break;
+            }
+            else if(diff < 0)
+                return false;
+            else
+                pos=dequeuepos.load(std::memory_order_relaxed);
+        }
+        value=std::move(c->value);
+        c->value=T();
+        c->sequence.store(pos+mask+1,std::memory_order_release);
+        return true;
+    }
+    //Waits up to timeout milliseconds (ULONG_MAX for as long as it takes) for something to pop, or until cancelled()
+    //is true after a wakeAll(). It's checked under the wait mutex so a wakeAll() right after setting the flag can't be missed
+    template<class Cancelled> bool pop(T &value,unsigned long timeout,Cancelled cancelled)
+    {
+        if(tryPop(value)) return true;
+        QMutexLocker locker(&waitmutex);
+        sleepers.fetch_add(1,std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool popped=tryPop(value);
+        while(!popped && !cancelled())
+        {
+            bool woken=notempty.wait(&waitmutex,timeout);
+            popped=tryPop(value);
+            if(!woken) break;
+        }
+        sleepers.fetch_sub(1,std::memory_order_relaxed);
+        return popped;
+    }
+    bool pop(T &value,unsigned long timeout) { return pop(value,timeout,[]{ return false; }); }
+    //Wakes every blocked consumer to check its cancelled() again, e.g. when shutting down
+    void wakeAll()
+    {
+        QMutexLocker locker(&waitmutex);
+        notempty.wakeAll();
+    }
+};
+
+//N mpmcqueues where consumers always take from the lowest index (highest priority) that has something and block on
+//all of them at once. deferred counts pops that left lower priority items waiting
+template<class T,size_t N> class prioritympmcqueue
+{
+private:
+    std::unique_ptr<mpmcqueue<T>> queues[N];
+    alignas(64) std::atomic<int> sleepers{0};
+    QMutex waitmutex;
+    QWaitCondition notempty;
+public:
+    std::atomic<quint64> deferred{0};
+    explicit prioritympmcqueue(size_t capacity)
+    {
+        for(auto &queue : queues)
+            queue.reset(new mpmcqueue<T>(capacity));
+    }
+    prioritympmcqueue(const prioritympmcqueue&)=delete;
+    void operator=(const prioritympmcqueue&)=delete;
+    size_t size(size_t priority) const { return queues[priority]->size(); }
+    bool tryPush(size_t priority,T &&value)
+    {
+        if(!queues[priority]->tryPush(std::move(value)))
+            return false;
+        std::atomic_thread_fence(std::memory_order_seq_cst); //Same handshake with pop() as mpmcqueue
+        if(sleepers.load(std::memory_order_relaxed) > 0)
+        {
+            QMutexLocker locker(&waitmutex);
+            notempty.wakeOne();
+        }
+        return true;
+    }
+    bool tryPop(T &value)
+    {
+        for(size_t i=0; i < N; i++)
+        {
+            if(queues[i]->tryPop(value))
+            {
+                for(size_t j=i+1; j < N; j++)
+                {
+                    if(!queues[j]->empty())
+                    {
+                        deferred.fetch_add(1,std::memory_order_relaxed);
+                        break;
+                    }
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+    template<class Cancelled> bool pop(T &value,unsigned long timeout,Cancelled cancelled)
+    {
+        if(tryPop(value)) return true;
+        QMutexLocker locker(&waitmutex);
+        sleepers.fetch_add(1,std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool popped=tryPop(value);
+        while(!popped && !cancelled())
+        {
+            bool woken=notempty.wait(&waitmutex,timeout);
+            popped=tryPop(value);
+            if(!woken) break;
+        }
+        sleepers.fetch_sub(1,std::memory_order_relaxed);
+        return popped;
+    }
+    void wakeAll()
+    {
+        QMutexLocker locker(&waitmutex);
+        notempty.wakeAll();
+    }
+};
+
+#endif // MPMCQUEUE_H
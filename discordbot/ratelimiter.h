@@ -0,0 +1,298 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <deque>
+#include <memory>
+#include "httpsclient.h"
+
+//Central outbound scheduler for a bot's discord REST traffic, requests wait in their route's bucket
+//until the bucket (and the bot wide global limit) has room so they go out just in time instead of coming back 429
+class ratelimitedrequest
+{
+public:
+    httpsrequest request;
+    httpscallback callback;
+    QString route;
+    qint64 queuedat=0;
+};
+
+class ratelimitbucket
+{
+public:
+    QString id;
+    std::deque<ratelimitedrequest> queue;
+    int limit=1,remaining=1,inflight=0;
+    qint64 resetat=0;
+    bool known=false,scheduled=false;
+    quint64 sent=0,limited=0,waitmsecs=0,maxwaitmsecs=0;
+};
+
+class discordratelimiter : public std::enable_shared_from_this<discordratelimiter>
+{
+private:
+    inline static QMutex registrymutex;
+    inline static QHash<QString,std::shared_ptr<discordratelimiter>> registry;
+    QMutex mutex;
+    httpsclient https;
+    QHash<QString,QString> routes; //route -> X-RateLimit-Bucket plus the route's major parameter, until then the route is its own bucket
+    QHash<QString,ratelimitbucket> buckets;
+    qint64 globalresetat=0,windowstart=0;
+    int windowcount=0;
+    std::atomic<quint64> globallimited=0;
+public:
+    inline static int globallimit=50; //Requests per second per bot
+    std::atomic<bool> dryrun=false; //Requests are answered with an empty 200 without going out, e.g. while replaying a capture
+    std::atomic<quint64> dryrunrequests=0;
+    discordratelimiter(QString authorization,QString useragent)
+    {
+        https.setUseCompression(false);
+        https.setAuthorization(authorization);
+        https.setUserAgent(useragent);
+    }
+    inline static std::shared_ptr<discordratelimiter> forBot(QString authorization,QString useragent)
+    {
+        QMutexLocker locker(&registrymutex);
+        auto &limiter=registry[authorization];
+        if(!limiter)
+            limiter=std::make_shared<discordratelimiter>(authorization,useragent);
+        return limiter;
+    }
+    //Method plus path with only the major parameter (channel/guild/webhook id) kept, every other id collapses
+    inline static QString routeKey(const httpsrequest &request)
+    {
+        QString path=request.action.left(request.action.indexOf('?'));
+        QStringList parts=path.split('/');
+        for(int i=1; i < parts.size(); i++)
+        {
+            bool isId=false;
+            parts[i].toULongLong(&isId);
+            QString previous=parts.at(i-1);
+            if(isId && previous!="channels" && previous!="guilds" && previous!="webhooks")
+                parts[i]=":id";
+        }
+        return QString("%1 %2").arg(request.type==httpsrequest::type::POST ? "POST" : "GET").arg(parts.join('/'));
+    }
+    //"channels/<id>", "guilds/<id>" or "webhooks/<id>" out of a routeKey(), empty for routes without one
+    inline static QString majorParameter(const QString &route)
+    {
+        QStringList parts=route.split('/');
+        for(int i=0; i+1 < parts.size(); i++)
+        {
+            if(parts.at(i)=="channels" || parts.at(i)=="guilds" || parts.at(i)=="webhooks")
+                return parts.at(i)+"/"+parts.at(i+1);
+        }
+        return QString();
+    }
+    //Discord hands out the same bucket hash for every channel/guild/webhook, each of them still gets its own limits
+    inline static QString bucketKey(const QString &hash,const QString &route)
+    {
+        QString major=majorParameter(route);
+        return major.isEmpty() ? hash : hash+":"+major;
+    }
+    void submit(httpsrequest request,httpscallback callback)
+    {
+        if(dryrun)
+        {
+            dryrunrequests++;
+            httpsio::post([callback]
+            {
+                httpsresponse response;
+                response.status=200;
+                response.success=true;
+                if(callback) callback(response);
+            });
+            return;
+        }
+        QString id;
+        {
+            QMutexLocker locker(&mutex);
+            ratelimitedrequest item;
+            item.request=request;
+            item.callback=callback;
+            item.route=routeKey(request);
+            item.queuedat=QDateTime::currentMSecsSinceEpoch();
+            id=routes.value(item.route,item.route);
+            auto &bucket=buckets[id];
+            bucket.id=id;
+            bucket.queue.push_back(item);
+        }
+        pump(id);
+    }
+    httpsresponse send(httpsrequest request)
+    {
+        auto promise=std::make_shared<std::promise<httpsresponse>>();
+        auto future=promise->get_future();
+        submit(request,[promise](httpsresponse r){ promise->set_value(r); });
+        return future.get();
+    }
+    int queueDepth()
+    {
+        QMutexLocker locker(&mutex);
+        int depth=0;
+        for(auto &bucket : buckets)
+            depth+=bucket.queue.size();
+        return depth;
+    }
+    QString report()
+    {
+        QMutexLocker locker(&mutex);
+        QString r=QString("discordratelimiter global 429s: %1 buckets: %2").arg(globallimited).arg(buckets.size());
+        if(dryrunrequests) r+=QString(" dry run requests: %1").arg(dryrunrequests);
+        for(auto &bucket : buckets)
+        {
+            r+=QString("\n  bucket %1 queued: %2 remaining: %3/%4 sent: %5 429s: %6 avg wait: %7ms max wait: %8ms")
+                    .arg(bucket.id).arg(bucket.queue.size()).arg(bucket.remaining).arg(bucket.limit).arg(bucket.sent)
+                    .arg(bucket.limited).arg(bucket.sent ? bucket.waitmsecs/bucket.sent : 0).arg(bucket.maxwaitmsecs);
+        }
+        return r;
+    }
+    inline static QString reportAll()
+    {
+        QMutexLocker locker(&registrymutex);
+        QStringList reports;
+        for(auto &limiter : registry)
+            reports+=limiter->report();
+        return reports.join("\n");
+    }
+private:
+    void pump(QString id)
+    {
+        QMutexLocker locker(&mutex);
+        auto it=buckets.find(id);
+        if(it==buckets.end()) return;
+        ratelimitbucket &bucket=it.value();
+        while(!bucket.queue.empty())
+        {
+            qint64 now=QDateTime::currentMSecsSinceEpoch();
+            if(globalresetat > now)
+            {
+                schedule(bucket,globalresetat-now);
+                return;
+            }
+            if(!bucket.known && bucket.inflight > 0) return; //First response tells us the real limits
+            if(bucket.known && bucket.remaining <= 0)
+            {
+                if(bucket.resetat > now)
+                {
+                    schedule(bucket,bucket.resetat-now);
+                    return;
+                }
+                bucket.remaining=bucket.limit;
+            }
+            if(now-windowstart >= 1000)
+            {
+                windowstart=now;
+                windowcount=0;
+            }
+            if(windowcount >= globallimit)
+            {
+                schedule(bucket,windowstart+1000-now);
+                return;
+            }
+            ratelimitedrequest item=bucket.queue.front();
+            bucket.queue.pop_front();
+            bucket.remaining--;
+            bucket.inflight++;
+            bucket.sent++;
+            windowcount++;
+            quint64 waited=now-item.queuedat;
+            bucket.waitmsecs+=waited;
+            bucket.maxwaitmsecs=qMax(bucket.maxwaitmsecs,waited);
+            std::weak_ptr<discordratelimiter> self=shared_from_this();
+            https.sendAsync(item.request,[self,id,item](httpsresponse response)
+            {
+                if(auto limiter=self.lock())
+                    limiter->onResponse(id,item,response);
+                else if(item.callback)
+                    item.callback(response);
+            });
+        }
+    }
+    void schedule(ratelimitbucket &bucket,qint64 delay)
+    {
+        if(bucket.scheduled) return;
+        bucket.scheduled=true;
+        std::weak_ptr<discordratelimiter> self=shared_from_this();
+        QString id=bucket.id;
+        httpsio::post([self,id,delay]
+        {
+            QTimer::singleShot(delay,httpsio::context(),[self,id]
+            {
+                auto limiter=self.lock();
+                if(!limiter) return;
+                {
+                    QMutexLocker locker(&limiter->mutex);
+                    limiter->buckets[id].scheduled=false;
+                }
+                limiter->pump(id);
+            });
+        });
+    }
+    void onResponse(QString id,ratelimitedrequest item,httpsresponse response)
+    {
+        bool limited=(response.status==429);
+        QString newid;
+        {
+            QMutexLocker locker(&mutex);
+            qint64 now=QDateTime::currentMSecsSinceEpoch();
+            ratelimitbucket *bucket=&buckets[id];
+            bucket->inflight--;
+            QString buckethash=response.header("x-ratelimit-bucket");
+            QString bucketid=(buckethash.isEmpty() ? QString() : bucketKey(buckethash,item.route));
+            if(!bucketid.isEmpty() && bucketid!=id)
+            {
+                //Discord told us which shared bucket this route belongs to, move everything for the route over.
+                //The route carries the major parameter, so other channels/guilds stay in buckets of their own
+                newid=bucketid;
+                routes[item.route]=newid;
+                ratelimitbucket &target=buckets[newid];
+                target.id=newid;
+                for(auto q=bucket->queue.begin(); q!=bucket->queue.end();)
+                {
+                    if(q->route==item.route)
+                    {
+                        target.queue.push_back(*q);
+                        q=bucket->queue.erase(q);
+                    }
+                    else
+                        ++q;
+                }
+                bucket=&target;
+            }
+            QByteArray remaining=response.header("x-ratelimit-remaining");
+            if(!remaining.isEmpty())
+            {
+                bucket->known=true;
+                bucket->remaining=remaining.toInt();
+                bucket->limit=qMax(1,response.header("x-ratelimit-limit").toInt());
+                bucket->resetat=now+(qint64)(response.header("x-ratelimit-reset-after").toDouble()*1000);
+            }
+            if(limited)
+            {
+                qint64 retryafter=(qint64)(response.header("retry-after").toDouble()*1000);
+                if(response.header("x-ratelimit-global").toLower()=="true")
+                {
+                    globalresetat=now+retryafter;
+                    globallimited++;
+                }
+                else
+                {
+                    bucket->known=true;
+                    bucket->remaining=0;
+                    bucket->resetat=qMax(bucket->resetat,now+retryafter);
+                }
+                bucket->limited++;
+                item.queuedat=now;
+                bucket->queue.push_front(item);
+                qDebug() << "Rate limited on:" << item.route << "bucket:" << bucket->id << "retrying in:" << retryafter << "ms";
+            }
+        }
+        if(!limited && item.callback)
+            item.callback(response);
+        pump(id);
+        if(!newid.isEmpty())
+            pump(newid);
+    }
+};
+
+#endif // RATELIMITER_H
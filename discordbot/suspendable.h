@@ -7,6 +7,14 @@
 #include <QMutex>
 #include <QWaitCondition>
 #include <QDebug>
+#include <QUrlQuery>
+#include <QSet>
+#include "qcompressor.h"
+#include "etf.h"
+#include "fasthash.h"
+#include "gatewaycapture.h"
+
+Q_DECLARE_METATYPE(nlohmann::json)
 
 //Thank you Andrei Smirnov!
 //SuspendableWorker and Thread are for managing threads of objects that require signals/slots working (requring a QEventLoop)
@@ -51,16 +59,128 @@ public:
     }
 };
 
+//Decides from a payload's top level op and t alone whether it is worth parsing, so dispatches no handler wants
+//never get parsed, hashed or queued, they are dropped or only archived. Filled in before the shard connects, read only afterwards
+class gatewayfilter
+{
+public:
+    enum class route{PROCESS,ARCHIVE,DROP};
+    QSet<QString> wanted; //Dispatch event names some handler is registered for, empty lets everything through
+    bool archiveunwanted=true;
+    std::atomic<quint64> processed=0,archived=0,dropped=0;
+    route classify(int op,const QString &t)
+    {
+        route r=route::PROCESS;
+        //Control ops and the session events drive the connection itself and always go through
+        if(op==0 && !wanted.isEmpty() && t!="READY" && t!="RESUMED" && !wanted.contains(t))
+            r=(archiveunwanted ? route::ARCHIVE : route::DROP);
+        (r==route::PROCESS ? processed : r==route::ARCHIVE ? archived : dropped)++;
+        return r;
+    }
+    QString report()
+    {
+        return QString("gateway prefilter processed: %1 archived only: %2 dropped: %3").arg(processed).arg(archived).arg(dropped);
+    }
+    //Top level "op", "t" and "s" of a json payload (s is -1 when null), discord sends them ahead of "d" so this
+    //usually stops within the first few dozen characters
+    inline static bool peek(const QString &text,int &op,QString &t,qint64 &s)
+    {
+        const QChar *p=text.constData(),*end=p+text.size();
+        bool hasop=false,hast=false,hass=false;
+        int depth=0;
+        QChar last;
+        t.clear();
+        s=-1;
+        auto number=[&](qint64 &value)
+        {
+            bool negative=(p < end && *p=='-');
+            if(negative) p++;
+            const QChar *start=p;
+            for(value=0; p < end && p->isDigit(); p++)
+                value=value*10+p->digitValue();
+            if(negative) value=-value;
+            return p > start;
+        };
+        while(p < end && !(hasop && hast && hass))
+        {
+            QChar c=*p++;
+            if(c=='"')
+            {
+                const QChar *start=p;
+                for(; p < end && *p!='"'; p++)
+                    if(*p=='\\') p++;
+                if(p >= end) return false;
+                QStringView key(start,p-start);
+                p++;
+                if(depth==1 && (last=='{' || last==','))
+                {
+                    while(p < end && (p->isSpace() || *p==':')) p++;
+                    if(key==QLatin1String("op"))
+                    {
+                        qint64 value;
+                        hasop=number(value);
+                        op=(int)value;
+                    }
+                    else if(key==QLatin1String("s"))
+                    {
+                        hass=true;
+                        if(!number(s)) s=-1;
+                    }
+                    else if(key==QLatin1String("t"))
+                    {
+                        hast=true;
+                        if(p < end && *p=='"')
+                        {
+                            const QChar *value=++p;
+                            while(p < end && *p!='"') p++;
+                            t=QString(value,p-value);
+                            p++;
+                        }
+                    }
+                    last=':';
+                }
+                else
+                    last='"';
+                continue;
+            }
+            if(c=='{' || c=='[') depth++;
+            else if(c=='}' || c==']') depth--;
+            if(!c.isSpace()) last=c;
+        }
+        return hasop;
+    }
+};
+
 class WebSocketWorker : public SuspendableWorker
 {
     Q_OBJECT
+private:
+    //compress=zlib-stream: the whole connection is one zlib stream, each message ends in a sync flush (00 00 ff ff)
+    QCompressorStream inflater{QCompressorStream::format::ZLIB};
+    QByteArray compressed,inflated;
+    //Taken from the gateway url on open: encoding=etf means binary term format both ways, decoded here off the gui thread
+    bool zlibstream=false,etfencoding=false;
+    quint64 lastdispatch=0; //Highest dispatch sequence let through on this session
 public:
     QPointer<QWebSocket> wss=nullptr;
     std::atomic<bool> connected=false;
     std::atomic<uint64_t> connectionattempts=0,connectionfailures=0;
+    std::atomic<uint64_t> bytesonwire=0,bytesinflated=0,framesreceived=0;
+    std::atomic<quint64> sequence=0; //Last gateway sequence seen, including events the filter never let through
+    std::atomic<quint64> duplicates=0; //Dispatches dropped because their sequence was already seen
+    std::shared_ptr<gatewayfilter> filter; //Set once before the first connection
+    std::shared_ptr<gatewayrecorder> recorder; //Also set before the first connection when recording
+    quint16 shard=0;
     WebSocketWorker(QObject *parent=nullptr) : SuspendableWorker(parent) { }
+    QString report()
+    {
+        quint64 wire=bytesonwire,inflatedbytes=bytesinflated;
+        return QString("gateway frames: %1 bytes on wire: %2 bytes inflated: %3 (%4% of inflated size on the wire) replayed dispatches dropped: %5")
+                .arg(framesreceived).arg(wire).arg(inflatedbytes).arg(inflatedbytes ? 100.0*wire/inflatedbytes : 100.0,0,'f',1).arg(duplicates);
+    }
 signals:
-    void textMessageReceived(QString message);
+    void textMessageReceived(QString message,bool archiveonly);
+    void eventReceived(nlohmann::json event,bool archiveonly,quint64 payloadhash);
 public slots:
     void onOpenConnection(QString url)
     {
@@ -71,17 +191,38 @@ public slots:
         connect(wss,&QWebSocket::disconnected,this,&WebSocketWorker::onWebSocketDisconnected,Qt::UniqueConnection);
         connect(wss,QOverload<const QList<QSslError>&>::of(&QWebSocket::sslErrors),this,&WebSocketWorker::onWebSocketSslErrors,Qt::UniqueConnection);
         //Signal forwarding
-        connect(wss,&QWebSocket::textMessageReceived,this,&WebSocketWorker::textMessageReceived,Qt::UniqueConnection);
+        connect(wss,&QWebSocket::textMessageReceived,this,&WebSocketWorker::onTextFrame,Qt::UniqueConnection);
+        connect(wss,&QWebSocket::binaryMessageReceived,this,&WebSocketWorker::onBinaryFrame,Qt::UniqueConnection);
+        QUrlQuery query(QUrl(url).query());
+        zlibstream=(query.queryItemValue("compress")=="zlib-stream");
+        etfencoding=(query.queryItemValue("encoding")=="etf");
+        resetInflater();
         connectionattempts++;
         wss->open(QUrl(url));
     }
     qint64 onSendTextMessage(const QString &message)
     {
-        return wss->sendTextMessage(message);
+        if(!etfencoding)
+            return wss->sendTextMessage(message);
+        nlohmann::json payload=nlohmann::json::parse(message.toStdString(),nullptr,false);
+        if(payload.is_discarded())
+        {
+            qDebug() << "Not sending malformed gateway payload:" << message;
+            return -1;
+        }
+        return wss->sendBinaryMessage(etf::encode(payload));
     }
+    //Not a normal (1000) or going away (1001) close, those end the discord session and a restart couldn't resume it
     void onCloseConnection()
     {
-        if(connected) wss->close();
+        if(connected) wss->close(QWebSocketProtocol::CloseCode(4000),"resuming later");
+    }
+    //Drops the connection without a close handshake (a dead connection would never answer it, and a normal close
+    //would end the session) and dials straight back in so the hello can resume
+    void onReconnect(QString url)
+    {
+        if(wss) wss->abort();
+        onOpenConnection(url);
     }
     void onWebSocketConnected()
     {
@@ -89,9 +230,117 @@ public slots:
         connected=true;
         qDebug() << wss << "connected! on thread:" << QThread::currentThread();
     }
+    void onTextFrame(const QString &message)
+    {
+        framesreceived++;
+        quint64 size=message.size(); //Close enough to the utf-8 size for the counters, no need to encode it again
+        bytesonwire+=size;
+        bytesinflated+=size;
+        if(recorder)
+            recorder->record(shard,gatewaycapture::TEXT,message.toUtf8());
+        routeText(message);
+    }
+    void routeText(const QString &message)
+    {
+        int op=-1;
+        QString t;
+        qint64 s=-1;
+        if(!gatewayfilter::peek(message,op,t,s))
+        {
+            textMessageReceived(message,false);
+            return;
+        }
+        if(replayed(op,t,s)) return;
+        auto r=(filter ? filter->classify(op,t) : gatewayfilter::route::PROCESS);
+        if(r!=gatewayfilter::route::DROP)
+            textMessageReceived(message,r==gatewayfilter::route::ARCHIVE);
+    }
+    void onBinaryFrame(const QByteArray &frame)
+    {
+        framesreceived++;
+        bytesonwire+=frame.size();
+        const QByteArray *payload=&frame;
+        if(zlibstream)
+        {
+            compressed+=frame;
+            if(!compressed.endsWith(QByteArray::fromRawData("\x00\x00\xff\xff",4))) return; //Message continues in the next frame
+            inflated.resize(0);
+            bool ok=inflater.push(compressed.constData(),compressed.size(),inflated);
+            compressed.resize(0);
+            if(!ok)
+            {
+                qDebug() << "Gateway zlib-stream is corrupt, reconnecting...";
+                wss->abort();
+                return;
+            }
+            payload=&inflated;
+        }
+        bytesinflated+=payload->size();
+        if(recorder)
+            recorder->record(shard,etfencoding ? gatewaycapture::ETF : gatewaycapture::TEXT,*payload);
+        if(!etfencoding)
+        {
+            routeText(QString::fromUtf8(*payload));
+            return;
+        }
+        routeEtf(*payload);
+    }
+    //A captured payload goes the same way a live one would, prefilter and replay guard included
+    void onReplayFrame(gatewaycapture::frame frame)
+    {
+        framesreceived++;
+        bytesinflated+=frame.payload.size();
+        if(frame.type==gatewaycapture::ETF)
+            routeEtf(frame.payload);
+        else
+            routeText(QString::fromUtf8(frame.payload));
+    }
+    void routeEtf(const QByteArray &payload)
+    {
+        int op=-1;
+        std::string t;
+        qint64 s=-1;
+        auto r=gatewayfilter::route::PROCESS;
+        if(etf::peek(payload.constData(),payload.size(),op,t,s))
+        {
+            QString type=QString::fromStdString(t);
+            if(replayed(op,type,s)) return;
+            if(filter) r=filter->classify(op,type);
+            if(r==gatewayfilter::route::DROP) return;
+        }
+        nlohmann::json event;
+        if(!etf::decode(payload,event))
+        {
+            qDebug() << "Undecodable etf gateway payload of" << payload.size() << "bytes, reconnecting...";
+            if(wss) wss->abort();
+            return;
+        }
+        eventReceived(event,r==gatewayfilter::route::ARCHIVE,fasthash::of(payload));
+    }
+    //Dispatch sequences only go up within a session (READY starts a new one), anything at or below the last one
+    //is a replay and is dropped here before it gets parsed, hashed or queued
+    bool replayed(int op,const QString &t,qint64 s)
+    {
+        if(op!=0 || s < 0) return false;
+        if(t=="READY")
+            lastdispatch=0;
+        if((quint64)s <= lastdispatch)
+        {
+            duplicates++;
+            return true;
+        }
+        sequence=lastdispatch=s;
+        return false;
+    }
+    void resetInflater()
+    {
+        inflater.reset();
+        compressed.clear();
+    }
     void onWebSocketDisconnected()
     {
         connected=false;
+        resetInflater();
         qDebug() << wss << "connection lost on thread:" << QThread::currentThread();
     }
     void onWebSocketSslErrors(const QList<QSslError> &errors)
@@ -191,6 +440,76 @@ protected:
     }
 };
 
+//WorkerPool is for threads that only ever take work from a blocking source (a queue), unlike SuspendableThread nothing polls:
+//idle threads sleep inside the job until work arrives and suspended threads park on a wait condition until resumed.
+//The job does one item, blocking while there is none, and has to return once interrupted() is true and wake is called
+class WorkerPool
+{
+private:
+    std::function<void(WorkerPool&)> job;
+    std::function<void()> wake;
+    std::vector<std::unique_ptr<QThread>> threads;
+    std::atomic<bool> stopping=false,suspended=false;
+    QMutex parkmutex;
+    QWaitCondition unparked;
+    void loop()
+    {
+        qDebug() << QThread::currentThread() << "started!";
+        while(!stopping)
+        {
+            if(suspended)
+            {
+                QMutexLocker locker(&parkmutex);
+                while(suspended && !stopping)
+                    unparked.wait(&parkmutex);
+                continue;
+            }
+            job(*this);
+        }
+        qDebug() << QThread::currentThread() << "exited!";
+    }
+public:
+    WorkerPool(qint64 count,std::function<void(WorkerPool&)> job,std::function<void()> wake) : job(job),wake(wake)
+    {
+        for(qint64 i=0; i < count; i++)
+        {
+            threads.push_back(std::unique_ptr<QThread>(QThread::create([this]{ loop(); })));
+            threads.back()->start();
+        }
+    }
+    ~WorkerPool() { stop(); }
+    WorkerPool(WorkerPool&)=delete;
+    void operator=(WorkerPool&)=delete;
+    size_t size() const { return threads.size(); }
+    //Jobs should stop waiting for work and return
+    bool interrupted() const { return stopping || suspended; }
+    //Threads finish the item they are on and then park, takes effect without waiting for them
+    void suspend()
+    {
+        suspended=true;
+        wake();
+    }
+    void resume()
+    {
+        QMutexLocker locker(&parkmutex);
+        suspended=false;
+        unparked.wakeAll();
+    }
+    //Blocks until every thread has exited
+    void stop()
+    {
+        {
+            QMutexLocker locker(&parkmutex);
+            stopping=true;
+            unparked.wakeAll();
+        }
+        wake();
+        for(auto &thread : threads)
+            thread->wait();
+        threads.clear();
+    }
+};
+
 //This is a non-blocking time delayer for threads
 class Waiter : QObject
 {